@@ -30,7 +30,9 @@
 #include "llvm/IR/Module.h"
 #include "llvm/Support/MemoryBuffer.h"
 
+#include <cassert>
 #include <cstdlib>
+#include <cstring>
 
 namespace bcinfo {
 
@@ -67,6 +69,7 @@ MetadataExtractor::MetadataExtractor(const char *bitcode, size_t bitcodeSize)
       mExportForEachNameList(NULL), mExportForEachSignatureList(NULL),
       mPragmaCount(0), mPragmaKeyList(NULL), mPragmaValueList(NULL),
       mObjectSlotCount(0), mObjectSlotList(NULL),
+      mStringPool(NULL), mStringPoolSize(0), mStringPoolUsed(0),
       mRSFloatPrecision(RS_FP_Full) {
   BitcodeWrapper wrapper(bitcode, bitcodeSize);
   mCompilerVersion = wrapper.getCompilerVersion();
@@ -81,6 +84,7 @@ MetadataExtractor::MetadataExtractor(const llvm::Module *module)
       mExportForEachNameList(NULL), mExportForEachSignatureList(NULL),
       mPragmaCount(0), mPragmaKeyList(NULL), mPragmaValueList(NULL),
       mObjectSlotCount(0), mObjectSlotList(NULL),
+      mStringPool(NULL), mStringPoolSize(0), mStringPoolUsed(0),
       mRSFloatPrecision(RS_FP_Full) {
   mCompilerVersion = RS_VERSION;  // Default to the actual current version.
   mOptimizationLevel = 3;
@@ -88,46 +92,19 @@ MetadataExtractor::MetadataExtractor(const llvm::Module *module)
 
 
 MetadataExtractor::~MetadataExtractor() {
-  if (mExportVarNameList) {
-    for (size_t i = 0; i < mExportVarCount; i++) {
-        delete [] mExportVarNameList[i];
-        mExportVarNameList[i] = NULL;
-    }
-  }
+  // The strings in the lists below all live in mStringPool.
   delete [] mExportVarNameList;
   mExportVarNameList = NULL;
 
-  if (mExportFuncNameList) {
-    for (size_t i = 0; i < mExportFuncCount; i++) {
-        delete [] mExportFuncNameList[i];
-        mExportFuncNameList[i] = NULL;
-    }
-  }
   delete [] mExportFuncNameList;
   mExportFuncNameList = NULL;
 
-  if (mExportForEachNameList) {
-    for (size_t i = 0; i < mExportForEachSignatureCount; i++) {
-        delete [] mExportForEachNameList[i];
-        mExportForEachNameList[i] = NULL;
-    }
-  }
   delete [] mExportForEachNameList;
   mExportForEachNameList = NULL;
 
   delete [] mExportForEachSignatureList;
   mExportForEachSignatureList = NULL;
 
-  for (size_t i = 0; i < mPragmaCount; i++) {
-    if (mPragmaKeyList) {
-      delete [] mPragmaKeyList[i];
-      mPragmaKeyList[i] = NULL;
-    }
-    if (mPragmaValueList) {
-      delete [] mPragmaValueList[i];
-      mPragmaValueList[i] = NULL;
-    }
-  }
   delete [] mPragmaKeyList;
   mPragmaKeyList = NULL;
   delete [] mPragmaValueList;
@@ -136,6 +113,9 @@ MetadataExtractor::~MetadataExtractor() {
   delete [] mObjectSlotList;
   mObjectSlotList = NULL;
 
+  delete [] mStringPool;
+  mStringPool = NULL;
+
   return;
 }
 
@@ -178,21 +158,54 @@ bool MetadataExtractor::populateObjectSlotMetadata(
 }
 
 
-static const char *createStringFromValue(llvm::Value *v) {
-  if (v->getValueID() != llvm::Value::MDStringVal) {
-    return NULL;
+// Return the number of bytes needed to copy the strings in the first
+// NumOperands operands of the nodes in Metadata, null-terminators included.
+static size_t getMetadataStringLength(const llvm::NamedMDNode *Metadata,
+                                      unsigned NumOperands) {
+  if (!Metadata) {
+    return 0;
   }
 
-  llvm::StringRef ref = static_cast<llvm::MDString*>(v)->getString();
+  size_t Length = 0;
+  for (unsigned i = 0, e = Metadata->getNumOperands(); i != e; i++) {
+    const llvm::MDNode *Node = Metadata->getOperand(i);
+    if (Node == NULL) {
+      continue;
+    }
+    for (unsigned j = 0; j < NumOperands && j < Node->getNumOperands(); j++) {
+      const llvm::Value *V = Node->getOperand(j);
+      if (V != NULL && V->getValueID() == llvm::Value::MDStringVal) {
+        Length += static_cast<const llvm::MDString*>(V)->getLength() + 1;
+      }
+    }
+  }
+
+  return Length;
+}
+
 
-  char *c = new char[ref.size() + 1];
+const char *MetadataExtractor::createString(llvm::StringRef ref) {
+  assert(mStringPoolUsed + ref.size() + 1 <= mStringPoolSize &&
+         "String pool too small!");
+
+  char *c = mStringPool + mStringPoolUsed;
   memcpy(c, ref.data(), ref.size());
   c[ref.size()] = '\0';
+  mStringPoolUsed += ref.size() + 1;
 
   return c;
 }
 
 
+const char *MetadataExtractor::createStringFromValue(llvm::Value *v) {
+  if (v->getValueID() != llvm::Value::MDStringVal) {
+    return NULL;
+  }
+
+  return createString(static_cast<llvm::MDString*>(v)->getString());
+}
+
+
 void MetadataExtractor::populatePragmaMetadata(
     const llvm::NamedMDNode *PragmaMetadata) {
   if (!PragmaMetadata) {
@@ -208,6 +221,8 @@ void MetadataExtractor::populatePragmaMetadata(
   const char **TmpValueList = new const char*[mPragmaCount];
 
   for (size_t i = 0; i < mPragmaCount; i++) {
+    TmpKeyList[i] = NULL;
+    TmpValueList[i] = NULL;
     llvm::MDNode *Pragma = PragmaMetadata->getOperand(i);
     if (Pragma != NULL && Pragma->getNumOperands() == 2) {
       llvm::Value *PragmaKeyMDS = Pragma->getOperand(0);
@@ -227,6 +242,9 @@ void MetadataExtractor::populatePragmaMetadata(
   bool RelaxedPragmaSeen = false;
   bool FullPragmaSeen = false;
   for (size_t i = 0; i < mPragmaCount; i++) {
+    if (mPragmaKeyList[i] == NULL) {
+      continue;
+    }
     if (!Relaxed.compare(mPragmaKeyList[i])) {
       RelaxedPragmaSeen = true;
     } else if (!Imprecise.compare(mPragmaKeyList[i])) {
@@ -283,6 +301,7 @@ bool MetadataExtractor::populateVarNameMetadata(
   const char **TmpNameList = new const char *[mExportVarCount];
 
   for (size_t i = 0; i < mExportVarCount; i++) {
+    TmpNameList[i] = NULL;
     llvm::MDNode *Name = VarNameMetadata->getOperand(i);
     if (Name != NULL && Name->getNumOperands() > 1) {
       TmpNameList[i] = createStringFromValue(Name->getOperand(0));
@@ -309,6 +328,7 @@ bool MetadataExtractor::populateFuncNameMetadata(
   const char **TmpNameList = new const char*[mExportFuncCount];
 
   for (size_t i = 0; i < mExportFuncCount; i++) {
+    TmpNameList[i] = NULL;
     llvm::MDNode *Name = FuncNameMetadata->getOperand(i);
     if (Name != NULL && Name->getNumOperands() == 1) {
       TmpNameList[i] = createStringFromValue(Name->getOperand(0));
@@ -329,14 +349,13 @@ bool MetadataExtractor::populateForEachMetadata(
     // section for ForEach. We generate a full signature for a "root" function
     // which means that we need to set the bottom 5 bits in the mask.
     mExportForEachSignatureCount = 1;
-    char **TmpNameList = new char*[mExportForEachSignatureCount];
-    TmpNameList[0] = new char[5];
-    strncpy(TmpNameList[0], "root", 5);
+    const char **TmpNameList = new const char*[mExportForEachSignatureCount];
+    TmpNameList[0] = createString("root");
 
     uint32_t *TmpSigList = new uint32_t[mExportForEachSignatureCount];
     TmpSigList[0] = 0x1f;
 
-    mExportForEachNameList = (const char**)TmpNameList;
+    mExportForEachNameList = TmpNameList;
     mExportForEachSignatureList = TmpSigList;
     return true;
   }
@@ -372,6 +391,10 @@ bool MetadataExtractor::populateForEachMetadata(
     }
   }
 
+  for (size_t i = 0; i < mExportForEachSignatureCount; i++) {
+    TmpNameList[i] = NULL;
+  }
+
   if (Names) {
     for (size_t i = 0; i < mExportForEachSignatureCount; i++) {
       llvm::MDNode *Name = Names->getOperand(i);
@@ -384,9 +407,7 @@ bool MetadataExtractor::populateForEachMetadata(
       ALOGE("mExportForEachSignatureCount = %zu, but should be 1",
             mExportForEachSignatureCount);
     }
-    char *RootName = new char[5];
-    strncpy(RootName, "root", 5);
-    TmpNameList[0] = RootName;
+    TmpNameList[0] = createString("root");
   }
 
   mExportForEachNameList = TmpNameList;
@@ -411,13 +432,20 @@ bool MetadataExtractor::extract() {
         llvm::StringRef(mBitcode, mBitcodeSize), "", false));
     std::string error;
 
+    // Only the named metadata is needed here, so load the module lazily: the
+    // reader skips over the function blocks instead of parsing every function
+    // body. The module-level metadata block is still decoded in full.
+    //
     // Module ownership is handled by the context, so we don't need to free it.
-    llvm::ErrorOr<llvm::Module* > errval = llvm::parseBitcodeFile(MEM.get(), *mContext);
+    llvm::ErrorOr<llvm::Module* > errval =
+        llvm::getLazyBitcodeModule(MEM.get(), *mContext);
     if (std::error_code ec = errval.getError()) {
         ALOGE("Could not parse bitcode file");
         ALOGE("%s", ec.message().c_str());
         return false;
     }
+    // The lazily loaded module now owns the buffer.
+    MEM.release();
     mModule = errval.get();
   }
 
@@ -434,6 +462,17 @@ bool MetadataExtractor::extract() {
   const llvm::NamedMDNode *ObjectSlotMetadata =
       mModule->getNamedMetadata(ObjectSlotMetadataName);
 
+  // All the extracted strings are copied into a single pool, which is
+  // released with the extractor. Size it for every string the nodes may
+  // reference, plus the "root" name of legacy scripts.
+  delete [] mStringPool;
+  mStringPoolSize = sizeof("root") +
+      getMetadataStringLength(ExportVarMetadata, 1) +
+      getMetadataStringLength(ExportFuncMetadata, 1) +
+      getMetadataStringLength(ExportForEachNameMetadata, 1) +
+      getMetadataStringLength(PragmaMetadata, 2);
+  mStringPool = new char[mStringPoolSize];
+  mStringPoolUsed = 0;
 
   if (!populateVarNameMetadata(ExportVarMetadata)) {
     ALOGE("Could not populate export variable metadata");
@@ -29,13 +29,16 @@
 #include <llvm/Support/ToolOutputFile.h>
 
 #include <ctype.h>
+#include <dirent.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <time.h>
 
 #include <errno.h>
 #include <sys/stat.h>
@@ -48,21 +51,29 @@
 
 // This file corresponds to the standalone bcinfo tool. It prints a variety of
 // information about a supplied bitcode input file.
+//
+// In batch mode (-b), it instead scans every bitcode file named in a list
+// file, or found under a directory, on a pool of threads (-j) and prints one
+// JSON object per file on stdout.
 
 std::string inFile;
 std::string outFile;
 std::string infoFile;
+std::string batchInput;
 
+extern char *optarg;
 extern int opterr;
 extern int optind;
 
 bool translateFlag = false;
 bool infoFlag = false;
 bool verbose = true;
+bool batchFlag = false;
+unsigned numThreads = 0;
 
 static int parseOption(int argc, char** argv) {
   int c;
-  while ((c = getopt(argc, argv, "itv")) != -1) {
+  while ((c = getopt(argc, argv, "itvb:j:")) != -1) {
     opterr = 0;
 
     switch(c) {
@@ -84,6 +95,15 @@ static int parseOption(int argc, char** argv) {
         verbose = true;
         break;
 
+      case 'b':
+        batchFlag = true;
+        batchInput = optarg;
+        break;
+
+      case 'j':
+        numThreads = atoi(optarg);
+        break;
+
       default:
         // Critical error occurs
         return 0;
@@ -91,6 +111,10 @@ static int parseOption(int argc, char** argv) {
     }
   }
 
+  if (batchFlag) {
+    return 1;
+  }
+
   if(optind >= argc) {
     fprintf(stderr, "input file required\n");
     return 0;
@@ -213,14 +237,14 @@ static void dumpMetadata(bcinfo::MetadataExtractor *ME) {
 }
 
 
-static size_t readBitcode(const char **bitcode) {
-  if (!inFile.length()) {
+static size_t readBitcode(const std::string &path, const char **bitcode) {
+  if (!path.length()) {
     fprintf(stderr, "input file required\n");
     return 0;
   }
 
   struct stat statInFile;
-  if (stat(inFile.c_str(), &statInFile) < 0) {
+  if (stat(path.c_str(), &statInFile) < 0) {
     fprintf(stderr, "Unable to stat input file: %s\n", strerror(errno));
     return 0;
   }
@@ -230,9 +254,14 @@ static size_t readBitcode(const char **bitcode) {
     return 0;
   }
 
-  FILE *in = fopen(inFile.c_str(), "r");
+  FILE *in = fopen(path.c_str(), "r");
   if (!in) {
-    fprintf(stderr, "Could not open input file %s\n", inFile.c_str());
+    fprintf(stderr, "Could not open input file %s\n", path.c_str());
+    return 0;
+  }
+
+  if (statInFile.st_size == 0) {
+    fclose(in);
     return 0;
   }
 
@@ -242,7 +271,7 @@ static size_t readBitcode(const char **bitcode) {
   size_t nread = fread((void*) *bitcode, 1, bitcodeSize, in);
 
   if (nread != bitcodeSize)
-      fprintf(stderr, "Could not read all of file %s\n", inFile.c_str());
+      fprintf(stderr, "Could not read all of file %s\n", path.c_str());
 
   fclose(in);
   return nread;
@@ -258,14 +287,349 @@ static void releaseBitcode(const char **bitcode) {
 }
 
 
+//===----------------------------------------------------------------------===//
+// Batch mode
+//===----------------------------------------------------------------------===//
+
+static void jsonString(std::string &out, const char *str) {
+  out += '"';
+  for (const char *c = (str != NULL) ? str : ""; *c != '\0'; c++) {
+    switch (*c) {
+      case '"':  out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      case '\t': out += "\\t"; break;
+      default:
+        if (static_cast<unsigned char>(*c) < 0x20) {
+          char buf[8];
+          snprintf(buf, sizeof(buf), "\\u%04x", *c);
+          out += buf;
+        } else {
+          out += *c;
+        }
+        break;
+    }
+  }
+  out += '"';
+}
+
+
+static void jsonUnsigned(std::string &out, const char *key, uint64_t value,
+                         bool last = false) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%llu", static_cast<unsigned long long>(value));
+  jsonString(out, key);
+  out += ':';
+  out += buf;
+  if (!last) {
+    out += ',';
+  }
+}
+
+
+static uint64_t nowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+// Scan one bitcode file and describe it as a JSON object in out. Return false
+// if the metadata of the file couldn't be extracted.
+static bool scanFile(const std::string &path, std::string &out) {
+  out = "{";
+  jsonString(out, "file");
+  out += ':';
+  jsonString(out, path.c_str());
+  out += ',';
+
+  uint64_t start = nowUs();
+  const char *bitcode = NULL;
+  size_t bitcodeSize = readBitcode(path, &bitcode);
+  const char *error = NULL;
+  uint64_t readTime = nowUs() - start;
+  uint64_t translateTime = 0;
+  uint64_t extractTime = 0;
+
+  bcinfo::BitcodeWrapper bcWrapper(bitcode, bitcodeSize);
+  unsigned int version = 0;
+  if (bcWrapper.getBCFileType() == bcinfo::BC_WRAPPER) {
+    version = bcWrapper.getTargetAPI();
+  } else if (translateFlag) {
+    version = 12;
+  }
+
+  // The translator and the extractor parse the bitcode in LLVMContexts of
+  // their own, so that the workers don't share any LLVM state.
+  std::unique_ptr<bcinfo::BitcodeTranslator> BT;
+  std::unique_ptr<bcinfo::MetadataExtractor> ME;
+  if (bitcode == NULL) {
+    error = "failed to read bitcode";
+  } else {
+    uint64_t translateStart = nowUs();
+    BT.reset(new bcinfo::BitcodeTranslator(bitcode, bitcodeSize, version));
+    bool translated = BT->translate();
+    translateTime = nowUs() - translateStart;
+    if (!translated) {
+      error = "failed to translate bitcode";
+    } else {
+      uint64_t extractStart = nowUs();
+      ME.reset(new bcinfo::MetadataExtractor(BT->getTranslatedBitcode(),
+                                             BT->getTranslatedBitcodeSize()));
+      bool extracted = ME->extract();
+      extractTime = nowUs() - extractStart;
+      if (!extracted) {
+        error = "failed to get metadata";
+      }
+    }
+  }
+  uint64_t parseTime = nowUs() - start;
+
+  jsonString(out, "ok");
+  out += (error == NULL) ? ":true," : ":false,";
+  if (error != NULL) {
+    jsonString(out, "error");
+    out += ':';
+    jsonString(out, error);
+    out += ',';
+  }
+
+  jsonString(out, "wrapper");
+  out += (bcWrapper.getBCFileType() == bcinfo::BC_WRAPPER) ? ":true," :
+                                                              ":false,";
+  jsonUnsigned(out, "targetAPI", version);
+  jsonUnsigned(out, "compilerVersion", bcWrapper.getCompilerVersion());
+  jsonUnsigned(out, "optimizationLevel", bcWrapper.getOptimizationLevel());
+
+  if (error == NULL) {
+    jsonString(out, "floatPrecision");
+    out += ':';
+    jsonString(out, (ME->getRSFloatPrecision() == bcinfo::RS_FP_Relaxed) ?
+                    "relaxed" : "full");
+    out += ',';
+
+    jsonUnsigned(out, "exportVarCount", ME->getExportVarCount());
+    jsonUnsigned(out, "exportFuncCount", ME->getExportFuncCount());
+    jsonUnsigned(out, "exportForEachCount",
+                 ME->getExportForEachSignatureCount());
+    jsonUnsigned(out, "objectSlotCount", ME->getObjectSlotCount());
+
+    jsonString(out, "kernels");
+    out += ":[";
+    const char **nameList = ME->getExportForEachNameList();
+    const uint32_t *sigList = ME->getExportForEachSignatureList();
+    for (size_t i = 0; i < ME->getExportForEachSignatureCount(); i++) {
+      out += (i == 0) ? "{" : ",{";
+      jsonString(out, "name");
+      out += ':';
+      jsonString(out, nameList[i]);
+      out += ',';
+      jsonUnsigned(out, "signature", sigList[i], /* last */true);
+      out += '}';
+    }
+    out += "],";
+
+    jsonString(out, "pragmas");
+    out += ":[";
+    const char **keyList = ME->getPragmaKeyList();
+    const char **valueList = ME->getPragmaValueList();
+    for (size_t i = 0; i < ME->getPragmaCount(); i++) {
+      out += (i == 0) ? "[" : ",[";
+      jsonString(out, keyList[i]);
+      out += ',';
+      jsonString(out, valueList[i]);
+      out += ']';
+    }
+    out += "],";
+  }
+
+  jsonUnsigned(out, "readTimeUs", readTime);
+  jsonUnsigned(out, "translateTimeUs", translateTime);
+  jsonUnsigned(out, "extractTimeUs", extractTime);
+  jsonUnsigned(out, "parseTimeUs", parseTime, /* last */true);
+  out += '}';
+
+  ME.reset();
+  BT.reset();
+  releaseBitcode(&bitcode);
+  return (error == NULL);
+}
+
+
+// Append the .bc files under dir to files. Symbolic links to .bc files are
+// followed, but symbolic links to directories aren't, so that a link loop
+// can't make the search recurse forever.
+static void collectBitcodeFiles(const std::string &dir,
+                                std::vector<std::string> &files) {
+  DIR *d = opendir(dir.c_str());
+  if (d == NULL) {
+    fprintf(stderr, "Could not open directory %s: %s\n", dir.c_str(),
+            strerror(errno));
+    return;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+      continue;
+    }
+
+    std::string path = dir + "/" + entry->d_name;
+    struct stat st;
+    if (lstat(path.c_str(), &st) < 0) {
+      continue;
+    }
+
+    if (S_ISLNK(st.st_mode)) {
+      if ((stat(path.c_str(), &st) < 0) || !S_ISREG(st.st_mode)) {
+        continue;
+      }
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+      collectBitcodeFiles(path, files);
+    } else if (S_ISREG(st.st_mode) && llvm::StringRef(path).endswith(".bc")) {
+      files.push_back(path);
+    }
+  }
+
+  closedir(d);
+}
+
+
+// Read the list of files to scan: either the .bc files under batchInput if it
+// is a directory, or the paths listed in it, one per line.
+static bool collectBatchFiles(std::vector<std::string> &files) {
+  struct stat st;
+  if (stat(batchInput.c_str(), &st) < 0) {
+    fprintf(stderr, "Unable to stat %s: %s\n", batchInput.c_str(),
+            strerror(errno));
+    return false;
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    collectBitcodeFiles(batchInput, files);
+    return true;
+  }
+
+  FILE *list = fopen(batchInput.c_str(), "r");
+  if (!list) {
+    fprintf(stderr, "Could not open file list %s\n", batchInput.c_str());
+    return false;
+  }
+
+  char line[4096];
+  while (fgets(line, sizeof(line), list) != NULL) {
+    size_t len = strlen(line);
+    while (len > 0 && isspace(static_cast<unsigned char>(line[len - 1]))) {
+      line[--len] = '\0';
+    }
+    if (len > 0) {
+      files.push_back(line);
+    }
+  }
+
+  fclose(list);
+  return true;
+}
+
+
+struct BatchState {
+  const std::vector<std::string> *files;
+  size_t next;
+  size_t failures;
+  pthread_mutex_t lock;
+};
+
+
+static void *batchWorker(void *arg) {
+  BatchState *state = static_cast<BatchState *>(arg);
+
+  while (true) {
+    pthread_mutex_lock(&state->lock);
+    size_t i = state->next++;
+    pthread_mutex_unlock(&state->lock);
+
+    if (i >= state->files->size()) {
+      break;
+    }
+
+    std::string result;
+    bool ok = scanFile((*state->files)[i], result);
+
+    // Print whole lines so that the output of the workers doesn't interleave.
+    pthread_mutex_lock(&state->lock);
+    fprintf(stdout, "%s\n", result.c_str());
+    if (!ok) {
+      state->failures++;
+    }
+    pthread_mutex_unlock(&state->lock);
+  }
+
+  return NULL;
+}
+
+
+static int runBatch() {
+  std::vector<std::string> files;
+  if (!collectBatchFiles(files)) {
+    return 1;
+  }
+
+  unsigned threads = numThreads;
+  if (threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = (cpus > 0) ? static_cast<unsigned>(cpus) : 1;
+  }
+  if (threads > files.size()) {
+    threads = (files.size() > 0) ? files.size() : 1;
+  }
+
+  BatchState state;
+  state.files = &files;
+  state.next = 0;
+  state.failures = 0;
+  pthread_mutex_init(&state.lock, NULL);
+
+  std::vector<pthread_t> workers;
+  for (unsigned i = 0; i < threads; i++) {
+    pthread_t worker;
+    if (pthread_create(&worker, NULL, batchWorker, &state) != 0) {
+      fprintf(stderr, "Could not create worker thread %u\n", i);
+      break;
+    }
+    workers.push_back(worker);
+  }
+
+  if (workers.empty()) {
+    // Scan the files on this thread.
+    batchWorker(&state);
+  }
+
+  for (size_t i = 0; i < workers.size(); i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  pthread_mutex_destroy(&state.lock);
+  fflush(stdout);
+
+  return (state.failures == 0) ? 0 : 7;
+}
+
+
 int main(int argc, char** argv) {
   if(!parseOption(argc, argv)) {
     fprintf(stderr, "failed to parse option\n");
     return 1;
   }
 
+  if (batchFlag) {
+    return runBatch();
+  }
+
   const char *bitcode = NULL;
-  size_t bitcodeSize = readBitcode(&bitcode);
+  size_t bitcodeSize = readBitcode(inFile, &bitcode);
 
   unsigned int version = 0;
 
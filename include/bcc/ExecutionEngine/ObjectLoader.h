@@ -59,6 +59,10 @@ public:
 
   size_t getSymbolSize(const char *pName) const;
 
+  // Get the address the section at pIndex in the section header table of the
+  // object was loaded at, or NULL if it isn't loaded.
+  void *getSectionAddress(unsigned pIndex) const;
+
   // Get the symbol name where the symbol is of the type pType. If kUnknownType
   // is given, it returns all symbols' names in the object.
   bool getSymbolNameList(android::Vector<const char *>& pNameList,
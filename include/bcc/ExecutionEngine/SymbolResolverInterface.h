@@ -32,6 +32,16 @@ public:
   // Should this be a const method?
   virtual void *getAddress(const char *pName) = 0;
 
+  // Resolve the pCount distinct symbols named in pNames at once and store
+  // their address (or NULL if not found) at the same index in pAddresses.
+  // Resolvers which can do better than one lookup per name override it.
+  virtual void getAddresses(const char *const *pNames, size_t pCount,
+                            void **pAddresses) {
+    for (size_t i = 0; i < pCount; i++) {
+      pAddresses[i] = getAddress(pNames[i]);
+    }
+  }
+
   virtual ~SymbolResolverInterface() { }
 };
 
@@ -34,6 +34,11 @@ public:
   void chainResolver(SymbolResolverInterface &pResolver);
 
   virtual void *getAddress(const char *pName);
+
+  // Look up the names in each resolver of the chain in turn, passing on only
+  // those the previous resolvers didn't find.
+  virtual void getAddresses(const char *const *pNames, size_t pCount,
+                            void **pAddresses);
 };
 
 } // end namespace bcc
@@ -17,8 +17,10 @@
 #ifndef BCC_EXECUTION_ENGINE_SYMBOL_RESOLVERS_H
 #define BCC_EXECUTION_ENGINE_SYMBOL_RESOLVERS_H
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
+#include <vector>
 
 #include "SymbolResolverInterface.h"
 
@@ -39,6 +41,8 @@ public:
   // If pFileName is NULL, it will search symbol in the current process image.
   DyldSymbolResolver(const char *pFileName, bool pLazyBinding = true);
 
+  // getAddresses() is left to the default implementation: one dlsym() per
+  // name, through getAddress() so that subclasses can filter the names.
   virtual void *getAddress(const char *pName);
 
   inline bool hasError() const
@@ -71,6 +75,19 @@ private:
                     reinterpret_cast<const SymbolMap *>(pB)->mName);
   }
 
+  // Order the indices of an array of names by the names they refer to.
+  class NameIndexOrder {
+  private:
+    const char *const *mNames;
+
+  public:
+    NameIndexOrder(const char *const *pNames) : mNames(pNames) { }
+
+    bool operator()(size_t pA, size_t pB) const {
+      return (::strcmp(mNames[pA], mNames[pB]) < 0);
+    }
+  };
+
 public:
   ArraySymbolResolver(bool pSorted = false) : mSorted(pSorted) { }
 
@@ -98,6 +115,36 @@ public:
 
     return ((result != NULL) ? result->mAddr : NULL);
   }
+
+  virtual void getAddresses(const char *const *pNames, size_t pCount,
+                            void **pAddresses) {
+    if (!mSorted) {
+      SymbolResolverInterface::getAddresses(pNames, pCount, pAddresses);
+      return;
+    }
+
+    // Sort the names and merge them with the symbol array in a single pass.
+    std::vector<size_t> order(pCount);
+    for (size_t i = 0; i < pCount; i++) {
+      order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), NameIndexOrder(pNames));
+
+    size_t j = 0;
+    for (size_t i = 0; i < pCount; i++) {
+      const char *name = pNames[order[i]];
+      int compare = -1;
+      while (j < Subclass::NumSymbols) {
+        compare = ::strcmp(Subclass::SymbolArray[j].mName, name);
+        if (compare >= 0) {
+          break;
+        }
+        j++;
+      }
+      pAddresses[order[i]] = ((j < Subclass::NumSymbols) && (compare == 0)) ?
+                             Subclass::SymbolArray[j].mAddr : NULL;
+    }
+  }
 };
 
 template<typename ContextTy = void *>
@@ -24,6 +24,14 @@
 #include "bcc/Renderscript/RSCompiler.h"
 #include "bcc/Renderscript/RSScript.h"
 
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+  class Module;
+}
+
 namespace bcc {
 
 class BCCContext;
@@ -54,6 +62,33 @@ private:
   // and work with.
   bool mEnableGlobalMerge;
 
+  // Kernel chains to fuse into a single ForEach-able kernel. Each entry is the
+  // name of the fused kernel and the names of the kernels it calls, in order.
+  typedef std::pair<std::string, std::vector<std::string> > FusedKernelTy;
+  std::vector<FusedKernelTy> mFusedKernels;
+
+  // Distance in elements at which expanded kernels prefetch their inputs, or
+  // 0 to only prefetch in the kernels marked with "#pragma rs_prefetch".
+  unsigned mPrefetchDistance;
+
+  // Do expanded kernels write their output with non-temporal stores? If not,
+  // only the kernels marked with "#pragma rs_nontemporal" do.
+  bool mEnableNonTemporalStores;
+
+  // Do scripts compiled for 64-bit targets get the .expand64 variant of their
+  // kernels?
+  bool mEnableWideOffsets;
+
+  // Instrumentation of the expanded kernels.
+  RSKernelStatsMode mKernelStatsMode;
+
+  // Values of the exported variables the scripts are specialized on.
+  RSExportVarValueMapTy mExportVarValues;
+
+  // Declare the fused kernels in the metadata of pModule, so that they get
+  // expanded and exported like any other kernel. Return false on error.
+  bool addFusedKernelMetadata(llvm::Module &pModule);
+
   // Setup the compiler config for the given script. Return true if mConfig has
   // been changed and false if it remains unchanged.
   bool setupConfig(const RSScript &pScript);
@@ -64,10 +99,13 @@ private:
   // - pSourceHash and commandLineToEmbed are values to embed in the RSInfo for future cache
   //   invalidation decision.
   // - If pDumpIR is true, a ".ll" file will also be created.
+  // - If pUsage is not NULL, the kernels and invokable functions it doesn't
+  //   list are dropped and marked absent in the RSInfo.
   Compiler::ErrorCode compileScript(RSScript& pScript, const char* pScriptName,
                                     const char* pOutputPath, const char* pRuntimePath,
                                     const RSInfo::DependencyHashTy& pSourceHash,
-                                    const char* commandLineToEmbed, bool saveInfoFile, bool pDumpIR);
+                                    const char* commandLineToEmbed, bool saveInfoFile, bool pDumpIR,
+                                    const RSUsageManifest* pUsage = NULL);
 
 public:
   RSCompilerDriver(bool pUseCompilerRT = true);
@@ -104,14 +142,99 @@ public:
     return mEnableGlobalMerge;
   }
 
+  // Fuse the chain of pass-by-value kernels pKernels (A -> B -> C) into a
+  // single kernel pFusedName in the scripts built by this driver. The fused
+  // kernel is exported after the existing ones, so the slots of the unfused
+  // kernels don't change. Each kernel must take as its only input the result
+  // of the kernel preceding it.
+  void addFusedKernel(const std::string &pFusedName,
+                      const std::vector<std::string> &pKernels) {
+    mFusedKernels.push_back(FusedKernelTy(pFusedName, pKernels));
+  }
+
+  // Prefetch the inputs of every kernel v elements ahead of the element being
+  // processed. This helps large streaming kernels bound by memory bandwidth.
+  void setPrefetchDistance(unsigned v) {
+    mPrefetchDistance = v;
+  }
+
+  unsigned getPrefetchDistance() const {
+    return mPrefetchDistance;
+  }
+
+  // Bypass the cache when kernels store their output. Only kernels returning
+  // their result (and thus writing each element exactly once) are affected.
+  void setEnableNonTemporalStores(bool v) {
+    mEnableNonTemporalStores = v;
+  }
+
+  bool getEnableNonTemporalStores() const {
+    return mEnableNonTemporalStores;
+  }
+
+  // When the script has 64-bit pointers, also generate a "<kernel>.expand64"
+  // variant of the kernels which computes the offsets of the elements in 64
+  // bits, so that allocations larger than 4 GiB can be processed in a single
+  // launch. Whether the script got them is recorded in its RSInfo.
+  void setEnableWideOffsets(bool v) {
+    mEnableWideOffsets = v;
+  }
+
+  bool getEnableWideOffsets() const {
+    return mEnableWideOffsets;
+  }
+
+  // Make the expanded kernels count their invocations, the elements they
+  // process and, with RSKernelStatsCycles, the cycles they take. The counters
+  // are read with RSExecutable::getKernelStats().
+  void setKernelStatsMode(RSKernelStatsMode v) {
+    mKernelStatsMode = v;
+  }
+
+  RSKernelStatsMode getKernelStatsMode() const {
+    return mKernelStatsMode;
+  }
+
+  // Specialize the scripts built by this driver on the values of some of
+  // their exported variables, which the host promises not to change once the
+  // script is loaded. Uses of these variables are replaced with constants
+  // before LTO. The specialized object is cached under the name returned by
+  // getCacheResName(), which is the one to pass to loadScript().
+  void setExportVarValues(const RSExportVarValueMapTy &v) {
+    mExportVarValues = v;
+  }
+
+  const RSExportVarValueMapTy &getExportVarValues() const {
+    return mExportVarValues;
+  }
+
+  // Returns the resource name under which a script specialized on pValues is
+  // cached. This is pResName itself if pValues is empty, and pResName followed
+  // by a digest of the values otherwise.
+  static std::string GetSpecializedResName(const char *pResName,
+                                           const RSExportVarValueMapTy &pValues);
+
+  // Returns the resource name under which build() caches the script pResName
+  // built with pUsage and the current options of this driver. Everything
+  // changing the compiled object (usage manifest, export var values, fused
+  // kernels, prefetching, non-temporal stores, wide offsets and kernel
+  // statistics) goes into a digest appended to pResName, so that loadScript()
+  // with this name never picks up an object built with other options. This is
+  // pResName itself when none of them is set.
+  std::string getCacheResName(const char *pResName,
+                              const RSUsageManifest *pUsage = NULL) const;
+
   // FIXME: This method accompany with loadScript and compileScript should
   //        all be const-methods. They're not now because the getAddress() in
   //        SymbolResolverInterface is not a const-method.
   // Returns true if script is successfully compiled.
+  // If pUsage is given, only the kernels and invokable functions it lists are
+  // compiled. The other ones are reported as absent by the RSExecutable. The
+  // object is cached under getCacheResName(pResName, pUsage).
   bool build(BCCContext& pContext, const char* pCacheDir, const char* pResName,
              const char* pBitcode, size_t pBitcodeSize, const char* commandLine,
              const char* pRuntimePath, RSLinkRuntimeCallback pLinkRuntimeCallback = NULL,
-             bool pDumpIR = false);
+             bool pDumpIR = false, const RSUsageManifest* pUsage = NULL);
 
   // Returns true if script is successfully compiled.
   bool buildForCompatLib(RSScript &pScript, const char *pOut, const char *pRuntimePath);
@@ -32,6 +32,14 @@ class FileBase;
 class OutputFile;
 class SymbolResolverProxy;
 
+// Statistics of an expanded kernel, updated by the kernel itself when the
+// script is compiled with a kernel stats mode (see RSKernelStatsMode.)
+struct RSKernelStats {
+  uint64_t invocations;
+  uint64_t elements;
+  uint64_t cycles;
+};
+
 /*
  * RSExecutable holds the build results of a RSScript.
  */
@@ -48,6 +56,19 @@ private:
   android::Vector<void *> mExportVarAddrs;
   android::Vector<void *> mExportFuncAddrs;
   android::Vector<void *> mExportForeachFuncAddrs;
+  // Addresses of the .expand_spans entry points, NULL for the kernels which
+  // don't have one.
+  android::Vector<void *> mExportForeachSpansFuncAddrs;
+  // Addresses of the .expand_indexed entry points, NULL for the kernels which
+  // don't have one.
+  android::Vector<void *> mExportForeachIndexedFuncAddrs;
+  // Addresses of the .expand64 variants, all NULL unless
+  // RSInfo::hasWideOffsetKernels().
+  android::Vector<void *> mExportForeachWideFuncAddrs;
+
+  // Statistics of the kernels, one entry per foreach function. NULL if the
+  // script is not instrumented.
+  RSKernelStats *mKernelStats;
 
   // FIXME: These are designed for Renderscript HAL and is initialized in
   //        RSExecutable::Create(). Both of them come from RSInfo::getPragmas().
@@ -56,7 +77,8 @@ private:
   android::Vector<const char *> mPragmaValues;
 
   RSExecutable(RSInfo &pInfo, FileBase &pObjFile, ObjectLoader &pLoader)
-    : mInfo(&pInfo), mIsInfoDirty(false), mObjFile(&pObjFile), mLoader(&pLoader)
+    : mInfo(&pInfo), mIsInfoDirty(false), mObjFile(&pObjFile), mLoader(&pLoader),
+      mKernelStats(NULL)
   { }
 
 public:
@@ -94,12 +116,36 @@ public:
   // Disassemble and dump the relocated functions to the pOutput.
   void dumpDisassembly(OutputFile &pOutput) const;
 
+  // The functions and kernels left out of the usage manifest given at build
+  // time have a stub in these vectors, which aborts with an error when it is
+  // called. Their span, indexed and wide entry points are NULL.
   inline const android::Vector<void *> &getExportVarAddrs() const
   { return mExportVarAddrs; }
   inline const android::Vector<void *> &getExportFuncAddrs() const
   { return mExportFuncAddrs; }
   inline const android::Vector<void *> &getExportForeachFuncAddrs() const
   { return mExportForeachFuncAddrs; }
+  inline const android::Vector<void *> &getExportForeachSpansFuncAddrs() const
+  { return mExportForeachSpansFuncAddrs; }
+  inline const android::Vector<void *> &getExportForeachIndexedFuncAddrs() const
+  { return mExportForeachIndexedFuncAddrs; }
+  inline const android::Vector<void *> &getExportForeachWideFuncAddrs() const
+  { return mExportForeachWideFuncAddrs; }
+
+  // Return the address of the export function (resp. expanded foreach
+  // function) at pIdx. Return NULL and log an error if it was not compiled
+  // because it was left out of the usage manifest given at build time.
+  void *getExportFuncAddr(size_t pIdx) const;
+  void *getExportForeachFuncAddr(size_t pIdx) const;
+
+  // Return the live statistics of the foreach functions, in the order of
+  // RSInfo::getExportForeachFuncs(), or NULL if the script was not compiled
+  // with kernel statistics.
+  inline const RSKernelStats *getKernelStats() const
+  { return mKernelStats; }
+
+  // Log the statistics of the foreach functions.
+  void dumpKernelStats() const;
 
   inline const android::Vector<const char *> &getPragmaKeys() const
   { return mPragmaKeys; }
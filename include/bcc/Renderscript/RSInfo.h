@@ -19,8 +19,11 @@
 
 #include <stdint.h>
 
+#include <map>
+#include <set>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "bcc/Support/Log.h"
 #include "bcc/Support/Sha1Util.h"
@@ -28,6 +31,10 @@
 #include <utils/String8.h>
 #include <utils/Vector.h>
 
+namespace android {
+class FileMap;
+}
+
 namespace llvm {
 class Module;
 }
@@ -43,13 +50,37 @@ class RSScript;
 
 typedef llvm::Module* (*RSLinkRuntimeCallback) (bcc::RSScript *, llvm::Module *, llvm::Module *);
 
+// Values of exported variables to specialize a script on, keyed by the name of
+// the variable. Each value holds the bytes of the variable as laid out in
+// memory on the target.
+typedef std::map<std::string, std::vector<uint8_t> > RSExportVarValueMapTy;
+
+// What the expanded kernels count in their entry of the ".rs.kernel_stats"
+// global (see RSExecutable::getKernelStats().)
+enum RSKernelStatsMode {
+  // No instrumentation.
+  RSKernelStatsNone,
+  // Count the invocations and the processed elements.
+  RSKernelStatsCounters,
+  // Also count the cycles spent in the kernels.
+  RSKernelStatsCycles
+};
+
+// The exported kernels and invokable functions a client is actually going to
+// call. When a script is built with a usage manifest, the other ones are
+// dropped before LTO and marked absent in its RSInfo.
+struct RSUsageManifest {
+  std::set<std::string> kernels;
+  std::set<std::string> invokables;
+};
+
 namespace rsinfo {
 
 /* RS info file magic */
 #define RSINFO_MAGIC      "\0rsinfo\n"
 
 /* RS info file version, encoded in 4 bytes of ASCII */
-#define RSINFO_VERSION    "006\0"
+#define RSINFO_VERSION    "011\0"
 
 struct __attribute__((packed)) ListHeader {
   // The offset from the beginning of the file of data
@@ -70,6 +101,8 @@ struct __attribute__((packed)) Header {
 
   uint8_t isThreadable;
   uint8_t hasDebugInformation;
+  // Whether the kernels have a .expand64 variant using 64-bit offsets.
+  uint8_t hasWideOffsetKernels;
 
   uint16_t headerSize;
 
@@ -88,6 +121,10 @@ struct __attribute__((packed)) Header {
   struct ListHeader exportVarNameList;
   struct ListHeader exportFuncNameList;
   struct ListHeader exportForeachFuncList;
+  struct ListHeader absentExportFuncList;
+  struct ListHeader absentExportForeachFuncList;
+  struct ListHeader exportForeachAnalysisList;
+  struct ListHeader exportSymbolList;
 };
 
 // Use value -1 as an invalid string index marker. No need to declare with
@@ -117,6 +154,42 @@ struct __attribute__((packed)) ExportForeachFuncItem {
   uint32_t signature;
 };
 
+// Index in the export func list of an invokable function which was left out
+// of the usage manifest the script was built with.
+struct __attribute__((packed)) AbsentExportFuncItem {
+  uint32_t index;
+};
+
+// Index in the export foreach list of a kernel which was left out of the usage
+// manifest the script was built with.
+struct __attribute__((packed)) AbsentExportForeachFuncItem {
+  uint32_t index;
+};
+
+// Result of the static analysis of a foreach function. There is one item per
+// item of the export foreach list, in the same order.
+struct __attribute__((packed)) ExportForeachAnalysisItem {
+  uint8_t isThreadable;
+  uint32_t costPerElement;
+  uint32_t minGrainSize;
+};
+
+/* Section of the export symbols which the compiled object doesn't define */
+#define RSINFO_ABSENT_SECTION 0xffffffffu
+
+// Location in the compiled object of an export var, an export func or an
+// expanded function of an export foreach. The list has either no item, or one
+// item per export var, export func and export foreach .expand function, then
+// one item per export foreach for each of its .expand_spans, .expand_indexed
+// and .expand64 functions, in this order.
+struct __attribute__((packed)) ExportSymbolItem {
+  // Index of the ELF section defining the symbol, 0 if it has to be looked up
+  // by name, or RSINFO_ABSENT_SECTION if the object doesn't define it.
+  uint32_t section;
+  // Offset of the symbol in that section.
+  uint32_t offset;
+};
+
 // Return the human-readable name of the given rsinfo::*Item in the template
 // parameter. This is for debugging and error message.
 template<typename Item>
@@ -142,6 +215,22 @@ template<>
 inline const char *GetItemTypeName<ExportForeachFuncItem>()
 { return "rs export foreach"; }
 
+template<>
+inline const char *GetItemTypeName<AbsentExportFuncItem>()
+{ return "rs absent export func"; }
+
+template<>
+inline const char *GetItemTypeName<AbsentExportForeachFuncItem>()
+{ return "rs absent export foreach"; }
+
+template<>
+inline const char *GetItemTypeName<ExportForeachAnalysisItem>()
+{ return "rs export foreach analysis"; }
+
+template<>
+inline const char *GetItemTypeName<ExportSymbolItem>()
+{ return "rs export symbol"; }
+
 } // end namespace rsinfo
 
 class RSInfo {
@@ -153,6 +242,28 @@ public:
   typedef android::Vector<const char *> ExportFuncNameListTy;
   typedef android::Vector<std::pair<const char *,
                                     uint32_t> > ExportForeachFuncListTy;
+  typedef android::Vector<uint32_t> AbsentExportFuncListTy;
+  typedef android::Vector<uint32_t> AbsentExportForeachFuncListTy;
+
+  // What the runtime needs to know to schedule a foreach function.
+  struct ForeachAnalysis {
+    // Can the elements be processed by several threads at once, i.e. does
+    // the kernel neither write to global variables nor call serializing
+    // runtime functions?
+    bool threadable;
+    // Estimated cost of processing one element, in instructions.
+    uint32_t costPerElement;
+    // Smallest number of elements worth handing to a worker thread.
+    uint32_t minGrainSize;
+  };
+  typedef android::Vector<ForeachAnalysis> ExportForeachAnalysisListTy;
+
+  // Where an export lives in the compiled object (see rsinfo::ExportSymbolItem.)
+  struct SymbolLocation {
+    uint32_t section;
+    uint32_t offset;
+  };
+  typedef android::Vector<SymbolLocation> ExportSymbolListTy;
 
 public:
   // Return the path of the RS info file corresponded to the given output
@@ -170,6 +281,12 @@ private:
 
   char *mStringPool;
 
+  // The mapped info file this RSInfo was read from, or NULL. When set,
+  // mStringPool points into it rather than to a copy, so it is read-only and
+  // stays mapped for the lifetime of the object. The file must therefore
+  // never be truncated in place (see writeFile().)
+  android::FileMap *mFileMap;
+
   // Pointer to the hash of the souce file, somewhere in the string pool.
   DependencyHashTy mSourceHash;
   // Pointer to the command used to compile this source, somewhere in the string pool.
@@ -183,6 +300,10 @@ private:
   ExportVarNameListTy mExportVarNames;
   ExportFuncNameListTy mExportFuncNames;
   ExportForeachFuncListTy mExportForeachFuncs;
+  AbsentExportFuncListTy mAbsentExportFuncs;
+  AbsentExportForeachFuncListTy mAbsentExportForeachFuncs;
+  ExportForeachAnalysisListTy mExportForeachAnalyses;
+  ExportSymbolListTy mExportSymbols;
 
   // Initialize an empty RSInfo with its size of string pool is pStringPoolSize.
   RSInfo(size_t pStringPoolSize);
@@ -207,6 +328,11 @@ public:
   // Implemneted in RSInfoWriter.cpp
   bool write(OutputFile &pOutput);
 
+  // Write the info to a temporary file and rename it to pInfoPath. Unlike
+  // truncating pInfoPath, this leaves the file mapped by the RSInfo read from
+  // it (in this or another process) intact. Implemented in RSInfoWriter.cpp.
+  bool writeFile(const char *pInfoPath);
+
   void dump() const;
 
   // const getter
@@ -214,6 +340,8 @@ public:
   { return mHeader.isThreadable; }
   inline bool hasDebugInformation() const
   { return mHeader.hasDebugInformation; }
+  inline bool hasWideOffsetKernels() const
+  { return mHeader.hasWideOffsetKernels; }
   inline const PragmaListTy &getPragmas() const
   { return mPragmas; }
   inline const ObjectSlotListTy &getObjectSlots() const
@@ -224,6 +352,22 @@ public:
   { return mExportFuncNames; }
   inline const ExportForeachFuncListTy &getExportForeachFuncs() const
   { return mExportForeachFuncs; }
+  inline const AbsentExportFuncListTy &getAbsentExportFuncs() const
+  { return mAbsentExportFuncs; }
+  inline const AbsentExportForeachFuncListTy &getAbsentExportForeachFuncs() const
+  { return mAbsentExportForeachFuncs; }
+  // Either empty or parallel to getExportForeachFuncs().
+  inline const ExportForeachAnalysisListTy &getExportForeachAnalyses() const
+  { return mExportForeachAnalyses; }
+  // Either empty or one entry per export var, export func and export foreach,
+  // in this order.
+  inline const ExportSymbolListTy &getExportSymbols() const
+  { return mExportSymbols; }
+
+  // Return true if the export func (resp. foreach) at pIdx was left out of
+  // the usage manifest the script was built with.
+  bool isExportFuncAbsent(size_t pIdx) const;
+  bool isExportForeachFuncAbsent(size_t pIdx) const;
 
   const char *getStringFromPool(rsinfo::StringIndexTy pStrIdx) const;
   rsinfo::StringIndexTy getStringIdxInPool(const char *pStr) const;
@@ -231,6 +375,20 @@ public:
   // setter
   inline void setThreadable(bool pThreadable = true)
   { mHeader.isThreadable = pThreadable; }
+  inline void setWideOffsetKernels(bool pWide = true)
+  { mHeader.hasWideOffsetKernels = pWide; }
+
+  // Mark the export funcs and foreach functions not listed in pUsage absent.
+  void applyUsageManifest(const RSUsageManifest &pUsage);
+
+  // Analyze the foreach functions of pModule, which must be the module the
+  // info was extracted from, and record the results in the info.
+  void analyzeForeachFuncs(const llvm::Module &pModule);
+
+  // Record where the exports are defined in the ELF relocatable object at
+  // pObjectPath, compiled from the script the info was extracted from.
+  // Implemented in RSInfoSymbols.cpp.
+  bool recordExportSymbols(const char *pObjectPath);
 
 public:
   enum FloatPrecision {
@@ -21,6 +21,10 @@
 #include "bcc/Renderscript/RSInfo.h"
 #include "bcc/Support/Sha1Util.h"
 
+namespace bcinfo {
+  class MetadataExtractor;
+}
+
 namespace bcc {
 
 class RSScript;
@@ -49,6 +53,23 @@ private:
 
   bool mEmbedInfo;
 
+  // Distance in elements to prefetch the inputs of the kernels at, or 0 to
+  // prefetch only for the kernels marked with "#pragma rs_prefetch".
+  unsigned mPrefetchDistance;
+
+  // Use non-temporal stores for the output of all kernels.
+  bool mEnableNonTemporalStores;
+
+  // Values of the exported variables to specialize the script on.
+  RSExportVarValueMapTy mExportVarValues;
+
+  // Instrumentation of the expanded kernels.
+  RSKernelStatsMode mKernelStatsMode;
+
+  // The RS metadata of the source, extracted once and shared by all the
+  // passes run on the script.
+  bcinfo::MetadataExtractor *mMetadata;
+
 private:
   // This will be invoked when the containing source has been reset.
   virtual bool doReset();
@@ -58,9 +79,7 @@ public:
 
   RSScript(Source &pSource);
 
-  virtual ~RSScript() {
-    delete mInfo;
-  }
+  virtual ~RSScript();
 
   // Set the associated RSInfo of the script.
   void setInfo(const RSInfo *pInfo) {
@@ -98,6 +117,47 @@ public:
   bool getEmbedInfo() const {
     return mEmbedInfo;
   }
+
+  void setPrefetchDistance(unsigned pDistance) {
+    mPrefetchDistance = pDistance;
+  }
+
+  unsigned getPrefetchDistance() const {
+    return mPrefetchDistance;
+  }
+
+  void setEnableNonTemporalStores(bool pEnable) {
+    mEnableNonTemporalStores = pEnable;
+  }
+
+  bool getEnableNonTemporalStores() const {
+    return mEnableNonTemporalStores;
+  }
+
+  void setExportVarValues(const RSExportVarValueMapTy &pValues) {
+    mExportVarValues = pValues;
+  }
+
+  const RSExportVarValueMapTy &getExportVarValues() const {
+    return mExportVarValues;
+  }
+
+  void setKernelStatsMode(RSKernelStatsMode pMode) {
+    mKernelStatsMode = pMode;
+  }
+
+  RSKernelStatsMode getKernelStatsMode() const {
+    return mKernelStatsMode;
+  }
+
+  // Extract the RS metadata from the source. This must be done again whenever
+  // the metadata of the source changes.
+  bool extractMetadata();
+
+  // Return NULL if the metadata hasn't been extracted yet.
+  const bcinfo::MetadataExtractor *getMetadata() const {
+    return mMetadata;
+  }
 };
 
 } // end namespace bcc
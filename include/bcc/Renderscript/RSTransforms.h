@@ -17,16 +17,46 @@
 #ifndef BCC_RS_TRANSFORMS_H
 #define BCC_RS_TRANSFORMS_H
 
+#include "bcc/Renderscript/RSInfo.h"
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringRef.h>
+
+namespace bcinfo {
+  class MetadataExtractor;
+}
+
 namespace llvm {
+  class Function;
+  class Module;
   class ModulePass;
 }
 
 namespace bcc {
 
+// Return true if the chain of kernels pKernels, whose foreach signatures are
+// pSignatures, can be fused into the single kernel pFusedName by the pass
+// created by createRSForEachExpandPass(). Log why not otherwise.
+bool canFuseKernels(llvm::StringRef pFusedName,
+                    llvm::ArrayRef<llvm::Function *> pKernels,
+                    llvm::ArrayRef<uint32_t> pSignatures);
+
 llvm::ModulePass *
-createRSForEachExpandPass(bool pEnableStepOpt);
+createRSForEachExpandPass(bool pEnableStepOpt, unsigned pPrefetchDistance = 0,
+                          bool pEnableNonTemporalStores = false,
+                          bool pEnableWideOffsets = false,
+                          RSKernelStatsMode pKernelStatsMode =
+                              RSKernelStatsNone,
+                          const bcinfo::MetadataExtractor *pMetadata = NULL);
 
-llvm::ModulePass * createRSEmbedInfoPass();
+llvm::ModulePass *
+createRSEmbedInfoPass(const bcinfo::MetadataExtractor *pMetadata = NULL);
+
+llvm::ModulePass *
+createRSSpecializeExportVarPass(const RSExportVarValueMapTy &pValues);
+
+llvm::ModulePass *
+createRSRelaxedMathPass(const llvm::Module *pRuntime);
 
 } // end namespace bcc
 
@@ -23,6 +23,8 @@
 namespace llvm {
   class Module;
   class NamedMDNode;
+  class StringRef;
+  class Value;
 }
 
 namespace bcinfo {
@@ -53,12 +55,20 @@ class MetadataExtractor {
   size_t mObjectSlotCount;
   const uint32_t *mObjectSlotList;
 
+  // Storage of all the strings returned by the getters below, owned by the
+  // extractor. They remain valid until it is destroyed.
+  char *mStringPool;
+  size_t mStringPoolSize;
+  size_t mStringPoolUsed;
+
   uint32_t mCompilerVersion;
   uint32_t mOptimizationLevel;
 
   enum RSFloatPrecision mRSFloatPrecision;
 
   // Helper functions for extraction
+  const char *createString(llvm::StringRef ref);
+  const char *createStringFromValue(llvm::Value *v);
   bool populateVarNameMetadata(const llvm::NamedMDNode *VarNameMetadata);
   bool populateFuncNameMetadata(const llvm::NamedMDNode *FuncNameMetadata);
   bool populateForEachMetadata(const llvm::NamedMDNode *Names,
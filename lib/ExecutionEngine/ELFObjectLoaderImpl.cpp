@@ -16,10 +16,17 @@
 
 #include "ELFObjectLoaderImpl.h"
 
+#include <cstring>
+#include <new>
+#include <vector>
+
 #include <llvm/Support/ELF.h>
+#include <llvm/Support/MathExtras.h>
 
 // The following files are included from librsloader.
 #include "ELFObject.h"
+#include "ELFSectionHeader.h"
+#include "ELFSectionHeaderTable.h"
 #include "ELFSectionSymTab.h"
 #include "ELFSymbol.h"
 #include "utils/serialize.h"
@@ -29,6 +36,110 @@
 
 using namespace bcc;
 
+namespace {
+
+// Return true if section pIdx of the object is loaded in the memory of the
+// process: it is allocated, or it holds the relocations of such a section.
+template<typename Ehdr, typename Shdr>
+bool isLoadedSection(const Ehdr &pHeader, const Shdr *pSections,
+                     unsigned pIdx) {
+  const Shdr &section = pSections[pIdx];
+  if (section.sh_flags & llvm::ELF::SHF_ALLOC) {
+    return true;
+  }
+  return (((section.sh_type == llvm::ELF::SHT_REL) ||
+           (section.sh_type == llvm::ELF::SHT_RELA)) &&
+          (section.sh_info < pHeader.e_shnum) &&
+          (pSections[section.sh_info].sh_flags & llvm::ELF::SHF_ALLOC));
+}
+
+// Build a copy of the ELF relocatable object at pMem without the contents of
+// its allocated sections (and of their relocations.) Those are loaded in the
+// memory of the process already, where the debugger reads them from once
+// prepareDebugImage() has set their sh_addr. Only the ELF header, the section
+// header table and the other sections (debug info, symbol and string tables)
+// are copied.
+template<typename Ehdr, typename Shdr>
+uint8_t *createCompactImage(const uint8_t *pMem, size_t pMemSize,
+                            size_t *pImageSize) {
+  const Ehdr *header = reinterpret_cast<const Ehdr *>(pMem);
+  if ((pMemSize < sizeof(Ehdr)) ||
+      (header->e_shentsize != sizeof(Shdr)) ||
+      (header->e_shoff > pMemSize) ||
+      ((pMemSize - header->e_shoff) / sizeof(Shdr) < header->e_shnum)) {
+    ALOGE("Invalid section header table in the object to debug!");
+    return NULL;
+  }
+
+  const Shdr *sections = reinterpret_cast<const Shdr *>(pMem +
+                                                        header->e_shoff);
+
+
+  // Lay out the image.
+  size_t image_size = sizeof(Ehdr);
+  for (unsigned i = 1; i < header->e_shnum; i++) {
+    if ((sections[i].sh_type == llvm::ELF::SHT_NOBITS) ||
+        isLoadedSection(*header, sections, i)) {
+      continue;
+    }
+    if ((sections[i].sh_offset > pMemSize) ||
+        (sections[i].sh_size > pMemSize - sections[i].sh_offset)) {
+      ALOGE("Section #%u is out of the object to debug!", i);
+      return NULL;
+    }
+    if (sections[i].sh_addralign > 1) {
+      image_size = llvm::RoundUpToAlignment(image_size,
+                                            sections[i].sh_addralign);
+    }
+    image_size += sections[i].sh_size;
+  }
+  size_t section_header_offset = llvm::RoundUpToAlignment(image_size,
+                                                          sizeof(void *));
+  image_size = section_header_offset + header->e_shnum * sizeof(Shdr);
+
+  uint8_t *image = new (std::nothrow) uint8_t [ image_size ];
+  if (image == NULL) {
+    ALOGE("Out of memory when creating the image of the object to debug!");
+    return NULL;
+  }
+  ::memset(image, 0, image_size);
+
+  Ehdr *image_header = reinterpret_cast<Ehdr *>(image);
+  ::memcpy(image_header, header, sizeof(Ehdr));
+  image_header->e_shoff = section_header_offset;
+  image_header->e_phoff = 0;
+  image_header->e_phnum = 0;
+
+  Shdr *image_sections = reinterpret_cast<Shdr *>(image +
+                                                  section_header_offset);
+  ::memcpy(image_sections, sections, header->e_shnum * sizeof(Shdr));
+
+  size_t offset = sizeof(Ehdr);
+  for (unsigned i = 1; i < header->e_shnum; i++) {
+    if (sections[i].sh_type == llvm::ELF::SHT_NOBITS) {
+      image_sections[i].sh_offset = 0;
+      continue;
+    }
+    if (isLoadedSection(*header, sections, i)) {
+      image_sections[i].sh_type = llvm::ELF::SHT_NOBITS;
+      image_sections[i].sh_offset = 0;
+      continue;
+    }
+    if (sections[i].sh_addralign > 1) {
+      offset = llvm::RoundUpToAlignment(offset, sections[i].sh_addralign);
+    }
+    ::memcpy(image + offset, pMem + sections[i].sh_offset,
+             sections[i].sh_size);
+    image_sections[i].sh_offset = offset;
+    offset += sections[i].sh_size;
+  }
+
+  *pImageSize = image_size;
+  return image;
+}
+
+} // end anonymous namespace
+
 bool ELFObjectLoaderImpl::load(const void *pMem, size_t pMemSize) {
   ArchiveReaderLE reader(reinterpret_cast<const unsigned char *>(pMem),
                          pMemSize);
@@ -53,13 +164,88 @@ bool ELFObjectLoaderImpl::load(const void *pMem, size_t pMemSize) {
 #endif
   if (mSymTab == NULL) {
     ALOGW("Object doesn't contain any symbol table.");
+    return true;
+  }
+
+  // Index the symbols by name so that each lookup doesn't have to scan the
+  // whole table.
+  for (size_t i = 0, e = mSymTab->size(); i != e; i++) {
+    SymbolTy *symbol = (*mSymTab)[i];
+    if ((symbol == NULL) || (symbol->getName() == NULL)) {
+      continue;
+    }
+    llvm::StringRef name(symbol->getName());
+    if (mSymbolIndex.count(name) == 0) {
+      mSymbolIndex[name] = symbol;
+    }
   }
 
   return true;
 }
 
+const ELFObjectLoaderImpl::SymbolTy *
+ELFObjectLoaderImpl::lookupSymbol(const char *pName) const {
+  llvm::StringMap<SymbolTy *>::const_iterator symbol =
+      mSymbolIndex.find(pName);
+  if (symbol == mSymbolIndex.end()) {
+    return NULL;
+  }
+  return symbol->getValue();
+}
+
+namespace {
+
+// Addresses of the undefined symbols of an object, resolved before it's
+// relocated. mIndex maps the name of each of them to its entry in mNames and
+// mAddresses.
+struct ResolvedSymbols {
+  llvm::StringMap<size_t> mIndex;
+  std::vector<const char *> mNames;
+  std::vector<void *> mAddresses;
+  SymbolResolverInterface *mResolver;
+};
+
+void *LookupResolvedSymbol(void *pContext, const char *pName) {
+  ResolvedSymbols *symbols = reinterpret_cast<ResolvedSymbols *>(pContext);
+  llvm::StringMap<size_t>::const_iterator symbol = symbols->mIndex.find(pName);
+  if (symbol != symbols->mIndex.end()) {
+    return symbols->mAddresses[symbol->getValue()];
+  }
+  // Not in the symbol table of the object (shouldn't happen.)
+  return symbols->mResolver->getAddress(pName);
+}
+
+} // end anonymous namespace
+
 bool ELFObjectLoaderImpl::relocate(SymbolResolverInterface &pResolver) {
-  mObject->relocate(SymbolResolverInterface::LookupFunction, &pResolver);
+  // The relocations of an object refer to the same few runtime functions over
+  // and over. Resolve each of its undefined symbols once, in a single batch,
+  // instead of going through pResolver for every relocation.
+  ResolvedSymbols symbols;
+  symbols.mResolver = &pResolver;
+  if (mSymTab != NULL) {
+    for (size_t i = 0, e = mSymTab->size(); i != e; i++) {
+      const SymbolTy *symbol = (*mSymTab)[i];
+      if ((symbol == NULL) || (symbol->getName() == NULL) ||
+          (symbol->getName()[0] == '\0') ||
+          (symbol->getSectionIndex() != llvm::ELF::SHN_UNDEF)) {
+        continue;
+      }
+      llvm::StringRef name(symbol->getName());
+      if (symbols.mIndex.count(name) == 0) {
+        symbols.mIndex[name] = symbols.mNames.size();
+        symbols.mNames.push_back(symbol->getName());
+      }
+    }
+  }
+
+  symbols.mAddresses.resize(symbols.mNames.size(), NULL);
+  if (!symbols.mNames.empty()) {
+    pResolver.getAddresses(&symbols.mNames[0], symbols.mNames.size(),
+                           &symbols.mAddresses[0]);
+  }
+
+  mObject->relocate(LookupResolvedSymbol, &symbols);
 
   if (mObject->getMissingSymbols()) {
     ALOGE("Some symbols are found to be undefined during relocation!");
@@ -69,6 +255,17 @@ bool ELFObjectLoaderImpl::relocate(SymbolResolverInterface &pResolver) {
   return true;
 }
 
+void *ELFObjectLoaderImpl::createDebugImage(const void *pMem, size_t pMemSize,
+                                            size_t *pDebugImgSize) {
+#ifdef __LP64__
+  return createCompactImage<llvm::ELF::Elf64_Ehdr, llvm::ELF::Elf64_Shdr>(
+      reinterpret_cast<const uint8_t *>(pMem), pMemSize, pDebugImgSize);
+#else
+  return createCompactImage<llvm::ELF::Elf32_Ehdr, llvm::ELF::Elf32_Shdr>(
+      reinterpret_cast<const uint8_t *>(pMem), pMemSize, pDebugImgSize);
+#endif
+}
+
 bool ELFObjectLoaderImpl::prepareDebugImage(void *pDebugImg,
                                             size_t pDebugImgSize) {
   // Update the value of sh_addr in pDebugImg to its corresponding section in
@@ -146,11 +343,7 @@ void *ELFObjectLoaderImpl::getSymbolAddress(const char *pName) const {
     return NULL;
   }
 
-#ifdef __LP64__
-  const ELFSymbol<64> *symbol = mSymTab->getByName(pName);
-#else
-  const ELFSymbol<32> *symbol = mSymTab->getByName(pName);
-#endif
+  const SymbolTy *symbol = lookupSymbol(pName);
   if (symbol == NULL) {
     ALOGV("Request symbol '%s' is not found in the object!", pName);
     return NULL;
@@ -165,11 +358,7 @@ size_t ELFObjectLoaderImpl::getSymbolSize(const char *pName) const {
     return 0;
   }
 
-#ifdef __LP64__
-  const ELFSymbol<64> *symbol = mSymTab->getByName(pName);
-#else
-  const ELFSymbol<32> *symbol = mSymTab->getByName(pName);
-#endif
+  const SymbolTy *symbol = lookupSymbol(pName);
 
   if (symbol == NULL) {
     ALOGV("Request symbol '%s' is not found in the object!", pName);
@@ -180,6 +369,39 @@ size_t ELFObjectLoaderImpl::getSymbolSize(const char *pName) const {
 
 }
 
+void *ELFObjectLoaderImpl::getSectionAddress(unsigned pIndex) const {
+  if ((pIndex == llvm::ELF::SHN_UNDEF) ||
+      (pIndex >= mObject->getHeader()->getSectionHeaderNum())) {
+    return NULL;
+  }
+
+  // pIndex comes from the RS info file, which may be stale or corrupted. Only
+  // the loaded sections with contents are ELFSectionBits; the caller looks the
+  // symbol up by name otherwise.
+  const SectionHeaderTy *header = (*mObject->getSectionHeaderTable())[pIndex];
+  if ((header == NULL) ||
+      ((header->getFlags() & llvm::ELF::SHF_ALLOC) == 0) ||
+      ((header->getType() != llvm::ELF::SHT_PROGBITS) &&
+       (header->getType() != llvm::ELF::SHT_NOBITS))) {
+    ALOGW("Section #%u of the object doesn't hold code or data!", pIndex);
+    return NULL;
+  }
+
+#ifdef __LP64__
+  ELFSectionBits<64> *section =
+      static_cast<ELFSectionBits<64> *>(mObject->getSectionByIndex(pIndex));
+#else
+  ELFSectionBits<32> *section =
+      static_cast<ELFSectionBits<32> *>(mObject->getSectionByIndex(pIndex));
+#endif
+  if (section == NULL) {
+    return NULL;
+  }
+
+  return reinterpret_cast<void *>(
+      reinterpret_cast<uintptr_t>(section->getBuffer()));
+}
+
 bool
 ELFObjectLoaderImpl::getSymbolNameList(android::Vector<const char *>& pNameList,
                                        ObjectLoader::SymbolType pType) const {
@@ -19,14 +19,23 @@
 
 #include "ObjectLoaderImpl.h"
 
-// ELFObject and ELFSectionSymTab comes from librsloader. They're both
-// defined under global scope without a namespace enclosed.
+#include <llvm/ADT/StringMap.h>
+
+// ELFObject, ELFSectionSymTab, ELFSymbol and ELFSectionHeader come from
+// librsloader. They're all defined under global scope without a namespace
+// enclosed.
 template <unsigned Bitwidth>
 class ELFObject;
 
 template <unsigned Bitwidth>
 class ELFSectionSymTab;
 
+template <unsigned Bitwidth>
+class ELFSymbol;
+
+template <unsigned Bitwidth>
+class ELFSectionHeader;
+
 namespace bcc {
 
 class ELFObjectLoaderImpl : public ObjectLoaderImpl {
@@ -34,11 +43,21 @@ private:
 #ifdef __LP64__
   ELFObject<64> *mObject;
   ELFSectionSymTab<64> *mSymTab;
+  typedef ELFSymbol<64> SymbolTy;
+  typedef ELFSectionHeader<64> SectionHeaderTy;
 #else
   ELFObject<32> *mObject;
   ELFSectionSymTab<32> *mSymTab;
+  typedef ELFSymbol<32> SymbolTy;
+  typedef ELFSectionHeader<32> SectionHeaderTy;
 #endif
 
+  // Index of the symbols in mSymTab by name, built once at load time. When
+  // several symbols have the same name, the first one in the table wins.
+  llvm::StringMap<SymbolTy *> mSymbolIndex;
+
+  const SymbolTy *lookupSymbol(const char *pName) const;
+
 public:
   ELFObjectLoaderImpl() : ObjectLoaderImpl(), mObject(NULL), mSymTab(NULL) { }
 
@@ -46,12 +65,17 @@ public:
 
   virtual bool relocate(SymbolResolverInterface &pResolver);
 
+  virtual void *createDebugImage(const void *pMem, size_t pMemSize,
+                                 size_t *pDebugImgSize);
+
   virtual bool prepareDebugImage(void *pDebugImg, size_t pDebugImgSize);
 
   virtual void *getSymbolAddress(const char *pName) const;
 
   virtual size_t getSymbolSize(const char *pName) const;
 
+  virtual void *getSectionAddress(unsigned pIndex) const;
+
   virtual bool getSymbolNameList(android::Vector<const char *>& pNameList,
                                  ObjectLoader::SymbolType pType) const;
   ~ELFObjectLoaderImpl();
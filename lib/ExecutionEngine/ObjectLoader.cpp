@@ -16,16 +16,51 @@
 
 #include "bcc/ExecutionEngine/ObjectLoader.h"
 
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
 #include <utils/FileMap.h>
 
 #include "bcc/ExecutionEngine/GDBJITRegistrar.h"
 #include "bcc/Support/FileBase.h"
 #include "bcc/Support/Log.h"
+#include "bcc/Support/Properties.h"
 
 #include "ELFObjectLoaderImpl.h"
 
 using namespace bcc;
 
+namespace {
+
+// Return true if the debug image of the objects should be registered with
+// GDB: either a debugger is tracing the process, or the user asked for it with
+// "adb shell setprop debug.bcc.gdbjit 1" (e.g. to attach a debugger later.)
+bool isDebuggerRequested() {
+  if (getProperty("debug.bcc.gdbjit")) {
+    return true;
+  }
+
+  FILE *status = ::fopen("/proc/self/status", "r");
+  if (status == NULL) {
+    return false;
+  }
+
+  bool traced = false;
+  char line[128];
+  while (::fgets(line, sizeof(line), status) != NULL) {
+    if (::strncmp(line, "TracerPid:", 10) == 0) {
+      traced = (::atoi(line + 10) != 0);
+      break;
+    }
+  }
+
+  ::fclose(status);
+  return traced;
+}
+
+} // end anonymous namespace
+
 ObjectLoader *ObjectLoader::Load(void *pMemStart, size_t pMemSize,
                                  const char *pName,
                                  SymbolResolverInterface &pResolver,
@@ -70,24 +105,31 @@ ObjectLoader *ObjectLoader::Load(void *pMemStart, size_t pMemSize,
   // GDB debugging is enabled. Note that error occurrs during the setup of
   // debugging won't failed the object load. Only a warning is issued to notify
   // that the debugging is disabled due to the failure.
-  if (pEnableGDBDebug) {
+  //
+  // The image is only built when a debugger may actually use it, since it
+  // costs memory for every loaded script with debug information.
+  if (pEnableGDBDebug && isDebuggerRequested()) {
     // GDB's JIT debugging requires the source object file corresponded to the
     // process image desired to debug with. And some fields in the object file
     // must be updated to record the runtime information after it's loaded into
     // memory. For example, GDB's JIT debugging requires an ELF file with the
     // value of sh_addr in the section header to be the memory address that the
-    // section lives in the process image. Therefore, a writable memory with its
-    // contents initialized to the contents of pFile is created.
-    result->mDebugImage = new (std::nothrow) uint8_t [ pMemSize ];
+    // section lives in the process image. Therefore, a writable copy of the
+    // headers and the debug information of pFile is created. The contents of
+    // the loaded sections are left out: the debugger reads them from the
+    // memory of the process.
+    size_t debug_image_size = 0;
+    result->mDebugImage = result->mImpl->createDebugImage(pMemStart, pMemSize,
+                                                          &debug_image_size);
     if (result->mDebugImage != NULL) {
-      ::memcpy(result->mDebugImage, pMemStart, pMemSize);
-      if (!result->mImpl->prepareDebugImage(result->mDebugImage, pMemSize)) {
+      if (!result->mImpl->prepareDebugImage(result->mDebugImage,
+                                            debug_image_size)) {
         ALOGW("GDB debug for %s is enabled by the user but won't work due to "
               "failure debug image preparation!", pName);
       } else {
         registerObjectWithGDB(
             reinterpret_cast<const ObjectBuffer *>(result->mDebugImage),
-            pMemSize);
+            debug_image_size);
       }
     }
   }
@@ -156,12 +198,21 @@ size_t ObjectLoader::getSymbolSize(const char *pName) const {
   return mImpl->getSymbolSize(pName);
 }
 
+void *ObjectLoader::getSectionAddress(unsigned pIndex) const {
+  return mImpl->getSectionAddress(pIndex);
+}
+
 bool ObjectLoader::getSymbolNameList(android::Vector<const char *>& pNameList,
                                      SymbolType pType) const {
   return mImpl->getSymbolNameList(pNameList, pType);
 }
 
 ObjectLoader::~ObjectLoader() {
+  if (mDebugImage != NULL) {
+    // GDB must not look at the image once it is freed.
+    deregisterObjectWithGDB(
+        reinterpret_cast<const ObjectBuffer *>(mDebugImage));
+  }
   delete mImpl;
   delete [] reinterpret_cast<uint8_t *>(mDebugImage);
 }
@@ -36,12 +36,19 @@ public:
 
   virtual bool relocate(SymbolResolverInterface &pResolver) = 0;
 
+  // Create the image of the object at pMem to register with GDB, or return
+  // NULL. It has to be deleted with delete [] on a uint8_t pointer.
+  virtual void *createDebugImage(const void *pMem, size_t pMemSize,
+                                 size_t *pDebugImgSize) = 0;
+
   virtual bool prepareDebugImage(void *pDebugImg, size_t pDebugImgSize) = 0;
 
   virtual void *getSymbolAddress(const char *pName) const = 0;
 
   virtual size_t getSymbolSize(const char *pName) const = 0;
 
+  virtual void *getSectionAddress(unsigned pIndex) const = 0;
+
   virtual bool getSymbolNameList(android::Vector<const char *>& pNameList,
                                  ObjectLoader::SymbolType pType) const = 0;
 
@@ -16,6 +16,8 @@
 
 #include "bcc/ExecutionEngine/SymbolResolverProxy.h"
 
+#include <vector>
+
 using namespace bcc;
 
 void *SymbolResolverProxy::getAddress(const char *pName) {
@@ -30,6 +32,38 @@ void *SymbolResolverProxy::getAddress(const char *pName) {
   return NULL;
 }
 
+void SymbolResolverProxy::getAddresses(const char *const *pNames,
+                                       size_t pCount, void **pAddresses) {
+  // Indices in pNames of the symbols not resolved yet.
+  std::vector<size_t> missing(pCount);
+  for (size_t i = 0; i < pCount; i++) {
+    pAddresses[i] = NULL;
+    missing[i] = i;
+  }
+
+  std::vector<const char *> names;
+  std::vector<void *> addrs;
+  for (size_t i = 0; (i < mChain.size()) && !missing.empty(); i++) {
+    names.resize(missing.size());
+    for (size_t j = 0; j < missing.size(); j++) {
+      names[j] = pNames[missing[j]];
+    }
+    addrs.assign(missing.size(), NULL);
+
+    mChain[i]->getAddresses(&names[0], names.size(), &addrs[0]);
+
+    size_t num_missing = 0;
+    for (size_t j = 0; j < missing.size(); j++) {
+      if (addrs[j] != NULL) {
+        pAddresses[missing[j]] = addrs[j];
+      } else {
+        missing[num_missing++] = missing[j];
+      }
+    }
+    missing.resize(num_missing);
+  }
+}
+
 void SymbolResolverProxy::chainResolver(SymbolResolverInterface &pResolver) {
   mChain.push_back(&pResolver);
 }
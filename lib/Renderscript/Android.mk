@@ -28,10 +28,14 @@ libbcc_renderscript_SRC_FILES := \
   RSExecutable.cpp \
   RSForEachExpand.cpp \
   RSInfo.cpp \
+  RSInfoAnalysis.cpp \
   RSInfoExtractor.cpp \
   RSInfoReader.cpp \
+  RSInfoSymbols.cpp \
   RSInfoWriter.cpp \
-  RSScript.cpp
+  RSRelaxedMath.cpp \
+  RSScript.cpp \
+  RSSpecializeExportVar.cpp
 
 #=====================================================================
 # Device Static Library: libbccRenderscript
@@ -22,6 +22,7 @@
 
 #include "bcc/Assert.h"
 #include "bcc/Renderscript/RSExecutable.h"
+#include "bcc/Renderscript/RSInfo.h"
 #include "bcc/Renderscript/RSScript.h"
 #include "bcc/Renderscript/RSTransforms.h"
 #include "bcc/Source.h"
@@ -34,12 +35,16 @@ bool RSCompiler::addInternalizeSymbolsPass(Script &pScript, llvm::PassManager &p
   // Add a pass to internalize the symbols that don't need to have global
   // visibility.
   RSScript &script = static_cast<RSScript &>(pScript);
-  llvm::Module &module = script.getSource().getModule();
-  bcinfo::MetadataExtractor me(&module);
-  if (!me.extract()) {
-    bccAssert(false && "Could not extract metadata for module!");
-    return false;
+  const RSInfo *info = script.getInfo();
+  const bcinfo::MetadataExtractor *metadata = script.getMetadata();
+  if (metadata == NULL) {
+    if (!script.extractMetadata()) {
+      bccAssert(false && "Could not extract metadata for module!");
+      return false;
+    }
+    metadata = script.getMetadata();
   }
+  const bcinfo::MetadataExtractor &me = *metadata;
 
   // The vector contains the symbols that should not be internalized.
   std::vector<const char *> export_symbols;
@@ -52,7 +57,8 @@ bool RSCompiler::addInternalizeSymbolsPass(Script &pScript, llvm::PassManager &p
   }
 
   // Visibility of symbols appeared in rs_export_var and rs_export_func should
-  // also be preserved.
+  // also be preserved, unless they were left out of the usage manifest.
+  // The ones which are internalized get removed by the global DCE below.
   size_t exportVarCount = me.getExportVarCount();
   size_t exportFuncCount = me.getExportFuncCount();
   size_t exportForEachCount = me.getExportForEachSignatureCount();
@@ -65,26 +71,53 @@ bool RSCompiler::addInternalizeSymbolsPass(Script &pScript, llvm::PassManager &p
     export_symbols.push_back(exportVarNameList[i]);
   }
 
+  bool has_absent_symbols = false;
   for (i = 0; i < exportFuncCount; ++i) {
+    if ((info != NULL) && info->isExportFuncAbsent(i)) {
+      has_absent_symbols = true;
+      continue;
+    }
     export_symbols.push_back(exportFuncNameList[i]);
   }
 
   // Expanded foreach functions should not be internalized, too.
-  // expanded_foreach_funcs keeps the .expand version of the kernel names
-  // around until createInternalizePass() is finished making its own
-  // copy of the visible symbols.
+  // expanded_foreach_funcs keeps the .expand, .expand_spans,
+  // .expand_indexed and .expand64 versions of the kernel names around until
+  // createInternalizePass() is finished making its own copy of the visible
+  // symbols.
+  static const char *expanded_suffixes[] = {
+    ".expand", ".expand_spans", ".expand_indexed", ".expand64"
+  };
+  static const size_t num_expanded_suffixes =
+      sizeof(expanded_suffixes) / sizeof(expanded_suffixes[0]);
+
   std::vector<std::string> expanded_foreach_funcs;
   for (i = 0; i < exportForEachCount; ++i) {
-    expanded_foreach_funcs.push_back(
-        std::string(exportForEachNameList[i]) + ".expand");
+    for (size_t j = 0; j < num_expanded_suffixes; ++j) {
+      expanded_foreach_funcs.push_back(
+          std::string(exportForEachNameList[i]) + expanded_suffixes[j]);
+    }
   }
 
   for (i = 0; i < exportForEachCount; i++) {
-      export_symbols.push_back(expanded_foreach_funcs[i].c_str());
+    if ((info != NULL) && info->isExportForeachFuncAbsent(i)) {
+      has_absent_symbols = true;
+      continue;
+    }
+    for (size_t j = 0; j < num_expanded_suffixes; ++j) {
+      export_symbols.push_back(
+          expanded_foreach_funcs[i * num_expanded_suffixes + j].c_str());
+    }
   }
 
   pPM.add(llvm::createInternalizePass(export_symbols));
 
+  // Drop the functions which are no longer reachable from the symbols kept
+  // above, so that LTO and codegen don't spend any time on them.
+  if (has_absent_symbols) {
+    pPM.add(llvm::createGlobalDCEPass());
+  }
+
   return true;
 }
 
@@ -94,14 +127,37 @@ bool RSCompiler::addExpandForEachPass(Script &pScript, llvm::PassManager &pPM) {
 
   // Expand ForEach on CPU path to reduce launch overhead.
   bool pEnableStepOpt = true;
-  pPM.add(createRSForEachExpandPass(pEnableStepOpt));
+  bool pEnableWideOffsets = (script.getInfo() != NULL) &&
+                            script.getInfo()->hasWideOffsetKernels();
+  pPM.add(createRSForEachExpandPass(pEnableStepOpt,
+                                    script.getPrefetchDistance(),
+                                    script.getEnableNonTemporalStores(),
+                                    pEnableWideOffsets,
+                                    script.getKernelStatsMode(),
+                                    script.getMetadata()));
   if (script.getEmbedInfo())
-    pPM.add(createRSEmbedInfoPass());
+    pPM.add(createRSEmbedInfoPass(script.getMetadata()));
+
+  return true;
+}
+
+bool RSCompiler::addSpecializeExportVarPass(Script &pScript,
+                                            llvm::PassManager &pPM) {
+  // Script passed to RSCompiler must be a RSScript.
+  RSScript &script = static_cast<RSScript &>(pScript);
+
+  // Turn the exported variables the host promised not to change into
+  // constants, so that LTO can propagate their values into the kernels.
+  if (!script.getExportVarValues().empty())
+    pPM.add(createRSSpecializeExportVarPass(script.getExportVarValues()));
 
   return true;
 }
 
 bool RSCompiler::beforeAddLTOPasses(Script &pScript, llvm::PassManager &pPM) {
+  if (!addSpecializeExportVarPass(pScript, pPM))
+    return false;
+
   if (!addExpandForEachPass(pScript, pPM))
     return false;
 
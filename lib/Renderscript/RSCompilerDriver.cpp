@@ -16,6 +16,8 @@
 
 #include "bcc/Renderscript/RSCompilerDriver.h"
 
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/IR/Metadata.h>
 #include <llvm/IR/Module.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/Path.h>
@@ -28,6 +30,7 @@
 #include "bcc/Renderscript/RSExecutable.h"
 #include "bcc/Renderscript/RSInfo.h"
 #include "bcc/Renderscript/RSScript.h"
+#include "bcc/Renderscript/RSTransforms.h"
 #include "bcc/Support/CompilerConfig.h"
 #include "bcc/Source.h"
 #include "bcc/Support/FileMutex.h"
@@ -58,7 +61,9 @@ static std::string getBuildFingerPrint() {
 
 RSCompilerDriver::RSCompilerDriver(bool pUseCompilerRT) :
     mConfig(NULL), mCompiler(), mDebugContext(false),
-    mLinkRuntimeCallback(NULL), mEnableGlobalMerge(true) {
+    mLinkRuntimeCallback(NULL), mEnableGlobalMerge(true),
+    mPrefetchDistance(0), mEnableNonTemporalStores(false),
+    mEnableWideOffsets(false), mKernelStatsMode(RSKernelStatsNone) {
   init::Initialize();
 }
 
@@ -215,15 +220,188 @@ bool RSCompilerDriver::setupConfig(const RSScript &pScript) {
   return changed;
 }
 
+// Return the index of the foreach-able function pName in the export list.
+static bool getExportForEachIndex(const llvm::NamedMDNode *pNames,
+                                  llvm::StringRef pName, unsigned *pIndex) {
+  for (unsigned i = 0, e = pNames->getNumOperands(); i != e; ++i) {
+    const llvm::MDNode *node = pNames->getOperand(i);
+    if ((node == NULL) || (node->getNumOperands() != 1)) {
+      continue;
+    }
+    const llvm::Value *name = node->getOperand(0);
+    if ((name != NULL) &&
+        (name->getValueID() == llvm::Value::MDStringVal) &&
+        (static_cast<const llvm::MDString *>(name)->getString() == pName)) {
+      *pIndex = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Return true if the expand pass generated the .expand64 variant of any of the
+// kernels exported by pInfo in the compiled module pModule.
+static bool hasWideOffsetKernels(const llvm::Module &pModule,
+                                 const RSInfo &pInfo) {
+  const RSInfo::ExportForeachFuncListTy &foreach_funcs =
+      pInfo.getExportForeachFuncs();
+  for (size_t i = 0; i < foreach_funcs.size(); i++) {
+    std::string wide_name(foreach_funcs[i].first);
+    wide_name.append(".expand64");
+    const llvm::Function *wide_func = pModule.getFunction(wide_name);
+    if ((wide_func != NULL) && !wide_func->isDeclaration()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool RSCompilerDriver::addFusedKernelMetadata(llvm::Module &pModule) {
+  if (mFusedKernels.empty()) {
+    return true;
+  }
+
+  llvm::LLVMContext &context = pModule.getContext();
+  llvm::NamedMDNode *names =
+      pModule.getNamedMetadata("#rs_export_foreach_name");
+  llvm::NamedMDNode *signatures =
+      pModule.getNamedMetadata("#rs_export_foreach");
+
+  if ((names == NULL) || (signatures == NULL) ||
+      (names->getNumOperands() != signatures->getNumOperands())) {
+    ALOGE("Script has no foreach-able kernels to fuse!");
+    return false;
+  }
+
+  // Check all the chains before touching the module, so that a chain which
+  // can't be fused fails the compilation instead of exporting a kernel which
+  // has no expanded function.
+  std::vector<uint32_t> fused_signatures;
+  for (size_t i = 0; i < mFusedKernels.size(); i++) {
+    const std::string &fused_name = mFusedKernels[i].first;
+    const std::vector<std::string> &kernels = mFusedKernels[i].second;
+    unsigned index;
+
+    if (kernels.size() < 2) {
+      ALOGE("Fused kernel '%s' needs at least two kernels!",
+            fused_name.c_str());
+      return false;
+    }
+
+    bool duplicate = false;
+    for (size_t j = 0; j < i; j++) {
+      if (mFusedKernels[j].first == fused_name) {
+        duplicate = true;
+        break;
+      }
+    }
+    if (duplicate || (pModule.getFunction(fused_name) != NULL) ||
+        getExportForEachIndex(names, fused_name, &index)) {
+      ALOGE("Fused kernel name '%s' is already in use!", fused_name.c_str());
+      return false;
+    }
+
+    // The fused kernel reads the input of its first kernel, writes the output
+    // of its last kernel and uses the coordinates if any of its kernels does.
+    // (Signature bits: 0x01 in, 0x02 out, 0x08 x, 0x10 y, 0x20 kernel.)
+    uint32_t fused_signature = 0x20;
+    llvm::SmallVector<llvm::Function *, 8> chain;
+    llvm::SmallVector<uint32_t, 8> signatures_of_chain;
+
+    for (size_t j = 0; j < kernels.size(); j++) {
+      uint32_t signature = 0;
+      llvm::Function *kernel = pModule.getFunction(kernels[j]);
+      if ((kernel == NULL) ||
+          !getExportForEachIndex(names, kernels[j], &index)) {
+        ALOGE("Unable to fuse '%s': '%s' is not a foreach-able kernel!",
+              fused_name.c_str(), kernels[j].c_str());
+        return false;
+      }
+
+      const llvm::MDNode *sig_node = signatures->getOperand(index);
+      const llvm::Value *sig_val =
+          (sig_node->getNumOperands() == 1) ? sig_node->getOperand(0) : NULL;
+      if ((sig_val == NULL) ||
+          (sig_val->getValueID() != llvm::Value::MDStringVal) ||
+          static_cast<const llvm::MDString *>(sig_val)->getString()
+              .getAsInteger(10, signature)) {
+        ALOGE("Invalid signature for kernel '%s'!", kernels[j].c_str());
+        return false;
+      }
+
+      if (j == 0) {
+        fused_signature |= (signature & 0x01);
+      }
+      if (j == kernels.size() - 1) {
+        fused_signature |= (signature & 0x02);
+      }
+      fused_signature |= (signature & 0x18);
+
+      chain.push_back(kernel);
+      signatures_of_chain.push_back(signature);
+    }
+
+    // The same check as the one RSForEachExpandPass does when it generates
+    // the fused kernel.
+    if (!canFuseKernels(fused_name, chain, signatures_of_chain)) {
+      return false;
+    }
+
+    fused_signatures.push_back(fused_signature);
+  }
+
+  llvm::NamedMDNode *fusion =
+      pModule.getOrInsertNamedMetadata("#rs_foreach_fusion");
+
+  for (size_t i = 0; i < mFusedKernels.size(); i++) {
+    const std::string &fused_name = mFusedKernels[i].first;
+    const std::vector<std::string> &kernels = mFusedKernels[i].second;
+
+    llvm::SmallVector<llvm::Value *, 8> chain;
+    chain.push_back(llvm::MDString::get(context, fused_name));
+    for (size_t j = 0; j < kernels.size(); j++) {
+      chain.push_back(llvm::MDString::get(context, kernels[j]));
+    }
+
+    names->addOperand(llvm::MDNode::get(context,
+        llvm::MDString::get(context, fused_name)));
+    signatures->addOperand(llvm::MDNode::get(context,
+        llvm::MDString::get(context, llvm::utostr(fused_signatures[i]))));
+    fusion->addOperand(llvm::MDNode::get(context, chain));
+  }
+
+  return true;
+}
+
 Compiler::ErrorCode RSCompilerDriver::compileScript(RSScript& pScript, const char* pScriptName,
                                                     const char* pOutputPath,
                                                     const char* pRuntimePath,
                                                     const RSInfo::DependencyHashTy& pSourceHash,
                                                     const char* compileCommandLineToEmbed,
-                                                    bool saveInfoFile, bool pDumpIR) {
+                                                    bool saveInfoFile, bool pDumpIR,
+                                                    const RSUsageManifest* pUsage) {
   // android::StopWatch compile_time("bcc: RSCompilerDriver::compileScript time");
   RSInfo *info = NULL;
 
+  //===--------------------------------------------------------------------===//
+  // Declare the fused kernels.
+  //===--------------------------------------------------------------------===//
+  // This must happen before extracting the RS info so that the fused kernels
+  // get their own foreach slots.
+  if (!addFusedKernelMetadata(pScript.getSource().getModule())) {
+    return Compiler::kErrInvalidSource;
+  }
+
+  //===--------------------------------------------------------------------===//
+  // Extract the RS metadata shared by the passes run on the script.
+  //===--------------------------------------------------------------------===//
+  // None of the passes change the export or pragma metadata, so this is done
+  // once per compilation.
+  if (!pScript.extractMetadata()) {
+    ALOGE("Failed to extract the metadata of script '%s'!", pScriptName);
+    return Compiler::kErrInvalidSource;
+  }
+
   //===--------------------------------------------------------------------===//
   // Extract RS-specific information from source bitcode.
   //===--------------------------------------------------------------------===//
@@ -235,6 +413,20 @@ Compiler::ErrorCode RSCompilerDriver::compileScript(RSScript& pScript, const cha
     return Compiler::kErrInvalidSource;
   }
 
+  if (pUsage != NULL) {
+    info->applyUsageManifest(*pUsage);
+  }
+
+  // Tell the runtime which kernels it may run in parallel and how to split
+  // their work. This looks at the script alone, before it is linked with the
+  // runtime.
+  info->analyzeForeachFuncs(pScript.getSource().getModule());
+
+  // Ask the expand pass for the .expand64 variants. It only generates them
+  // when the pointers of the module are 64-bit wide, so the flag is set again
+  // from what it actually generated once the script is compiled.
+  info->setWideOffsetKernels(mEnableWideOffsets);
+
   //===--------------------------------------------------------------------===//
   // Associate script with its info
   //===--------------------------------------------------------------------===//
@@ -242,6 +434,11 @@ Compiler::ErrorCode RSCompilerDriver::compileScript(RSScript& pScript, const cha
   // to do some transformation (e.g., expand foreach-able function.)
   pScript.setInfo(info);
 
+  pScript.setPrefetchDistance(mPrefetchDistance);
+  pScript.setEnableNonTemporalStores(mEnableNonTemporalStores);
+  pScript.setExportVarValues(mExportVarValues);
+  pScript.setKernelStatsMode(mKernelStatsMode);
+
   //===--------------------------------------------------------------------===//
   // Link RS script with Renderscript runtime.
   //===--------------------------------------------------------------------===//
@@ -317,17 +514,19 @@ Compiler::ErrorCode RSCompilerDriver::compileScript(RSScript& pScript, const cha
             Compiler::GetErrorString(compile_result));
       return Compiler::kErrInvalidSource;
     }
+
+    if (info->hasWideOffsetKernels()) {
+      info->setWideOffsetKernels(
+          hasWideOffsetKernels(pScript.getSource().getModule(), *info));
+    }
   }
 
   if (saveInfoFile) {
-    android::String8 info_path = RSInfo::GetPath(pOutputPath);
-    OutputFile info_file(info_path.string(), FileBase::kTruncate);
+    // Let the loader find the exports without searching the symbol table.
+    // Without this the exports are simply looked up by name.
+    info->recordExportSymbols(pOutputPath);
 
-    if (info_file.hasError()) {
-      ALOGE("Failed to open the info file %s for write! (%s)",
-            info_path.string(), info_file.getErrorMessage().c_str());
-      return Compiler::kErrInvalidSource;
-    }
+    android::String8 info_path = RSInfo::GetPath(pOutputPath);
 
     FileMutex<FileBase::kWriteLock> write_info_mutex(info_path.string());
     if (write_info_mutex.hasError() || !write_info_mutex.lock()) {
@@ -336,8 +535,9 @@ Compiler::ErrorCode RSCompilerDriver::compileScript(RSScript& pScript, const cha
       return Compiler::kErrInvalidSource;
     }
 
-    // Perform the write.
-    if (!info->write(info_file)) {
+    // Perform the write. A loaded RSExecutable may still map the previous info
+    // file, so it is replaced rather than truncated.
+    if (!info->writeFile(info_path.string())) {
       ALOGE("Failed to sync the RS info file %s!", info_path.string());
       return Compiler::kErrInvalidSource;
     }
@@ -346,6 +546,123 @@ Compiler::ErrorCode RSCompilerDriver::compileScript(RSScript& pScript, const cha
   return Compiler::kSuccess;
 }
 
+// Serialize the (sorted) map pValues unambiguously at the end of pKey.
+static void appendExportVarValues(std::string &pKey,
+                                  const RSExportVarValueMapTy &pValues) {
+  for (RSExportVarValueMapTy::const_iterator it = pValues.begin(),
+           end = pValues.end(); it != end; ++it) {
+    pKey.append(it->first);
+    pKey.push_back('\0');
+    pKey.append(llvm::utostr(it->second.size()));
+    pKey.push_back('\0');
+    if (!it->second.empty()) {
+      pKey.append(reinterpret_cast<const char *>(&it->second[0]),
+                  it->second.size());
+    }
+  }
+}
+
+// Serialize the (sorted) set of names pNames unambiguously at the end of pKey.
+static void appendNames(std::string &pKey, const std::set<std::string> &pNames) {
+  pKey.append(llvm::utostr(pNames.size()));
+  pKey.push_back('\0');
+  for (std::set<std::string>::const_iterator it = pNames.begin(),
+           end = pNames.end(); it != end; ++it) {
+    pKey.append(*it);
+    pKey.push_back('\0');
+  }
+}
+
+// Return pResName followed by the digest of pKey.
+static std::string getDigestedResName(const char *pResName,
+                                      const std::string &pKey) {
+  // Drop the extension, if any, so that it doesn't hide the digest when the
+  // caller replaces it with ".o".
+  llvm::SmallString<80> stem(pResName);
+  llvm::sys::path::replace_extension(stem, "");
+  std::string res_name(stem.str());
+
+  uint8_t digest[SHA1_DIGEST_LENGTH];
+  Sha1Util::GetSHA1DigestFromBuffer(digest, pKey.data(), pKey.size());
+
+  static const char hex_digits[] = "0123456789abcdef";
+  res_name.push_back('-');
+  for (size_t i = 0; i < SHA1_DIGEST_LENGTH; i++) {
+    res_name.push_back(hex_digits[digest[i] >> 4]);
+    res_name.push_back(hex_digits[digest[i] & 0xf]);
+  }
+
+  return res_name;
+}
+
+std::string
+RSCompilerDriver::GetSpecializedResName(const char *pResName,
+                                        const RSExportVarValueMapTy &pValues) {
+  if (pValues.empty()) {
+    return pResName;
+  }
+
+  // Name the object after the digest of the values.
+  std::string key;
+  appendExportVarValues(key, pValues);
+  return getDigestedResName(pResName, key);
+}
+
+std::string
+RSCompilerDriver::getCacheResName(const char *pResName,
+                                  const RSUsageManifest *pUsage) const {
+  if ((pUsage == NULL) && mFusedKernels.empty() && (mPrefetchDistance == 0) &&
+      !mEnableNonTemporalStores && !mEnableWideOffsets &&
+      (mKernelStatsMode == RSKernelStatsNone)) {
+    return GetSpecializedResName(pResName, mExportVarValues);
+  }
+
+  // Serialize every option changing the compiled object, each one tagged so
+  // that no two sets of options give the same key.
+  std::string key("values");
+  key.push_back('\0');
+  key.append(llvm::utostr(mExportVarValues.size()));
+  key.push_back('\0');
+  appendExportVarValues(key, mExportVarValues);
+
+  key.append("fused");
+  key.push_back('\0');
+  key.append(llvm::utostr(mFusedKernels.size()));
+  key.push_back('\0');
+  for (size_t i = 0; i < mFusedKernels.size(); i++) {
+    key.append(mFusedKernels[i].first);
+    key.push_back('\0');
+    key.append(llvm::utostr(mFusedKernels[i].second.size()));
+    key.push_back('\0');
+    for (size_t j = 0; j < mFusedKernels[i].second.size(); j++) {
+      key.append(mFusedKernels[i].second[j]);
+      key.push_back('\0');
+    }
+  }
+
+  if (pUsage != NULL) {
+    key.append("usage");
+    key.push_back('\0');
+    appendNames(key, pUsage->kernels);
+    appendNames(key, pUsage->invokables);
+  }
+
+  key.append("prefetch");
+  key.push_back('\0');
+  key.append(llvm::utostr(mPrefetchDistance));
+  key.push_back('\0');
+  key.append(mEnableNonTemporalStores ? "nontemporal" : "temporal");
+  key.push_back('\0');
+  key.append(mEnableWideOffsets ? "wide" : "narrow");
+  key.push_back('\0');
+  key.append("stats");
+  key.push_back('\0');
+  key.append(llvm::utostr(static_cast<unsigned>(mKernelStatsMode)));
+  key.push_back('\0');
+
+  return getDigestedResName(pResName, key);
+}
+
 bool RSCompilerDriver::build(BCCContext &pContext,
                              const char *pCacheDir,
                              const char *pResName,
@@ -354,7 +671,8 @@ bool RSCompilerDriver::build(BCCContext &pContext,
                              const char *commandLine,
                              const char *pRuntimePath,
                              RSLinkRuntimeCallback pLinkRuntimeCallback,
-                             bool pDumpIR) {
+                             bool pDumpIR,
+                             const RSUsageManifest *pUsage) {
     //  android::StopWatch build_time("bcc: RSCompilerDriver::build time");
   //===--------------------------------------------------------------------===//
   // Check parameters.
@@ -380,10 +698,12 @@ bool RSCompilerDriver::build(BCCContext &pContext,
 
   //===--------------------------------------------------------------------===//
   // Construct output path.
-  // {pCacheDir}/{pResName}.o
+  // {pCacheDir}/{pResName}.o, or {pCacheDir}/{pResName}-{digest}.o for a
+  // script built with options changing the compiled object (see
+  // getCacheResName().)
   //===--------------------------------------------------------------------===//
   llvm::SmallString<80> output_path(pCacheDir);
-  llvm::sys::path::append(output_path, pResName);
+  llvm::sys::path::append(output_path, getCacheResName(pResName, pUsage));
   llvm::sys::path::replace_extension(output_path, ".o");
 
   //===--------------------------------------------------------------------===//
@@ -414,7 +734,7 @@ bool RSCompilerDriver::build(BCCContext &pContext,
   Compiler::ErrorCode status = compileScript(script, pResName,
                                              output_path.c_str(),
                                              pRuntimePath, bitcode_sha1, commandLine,
-                                             true, pDumpIR);
+                                             true, pDumpIR, pUsage);
 
   return status == Compiler::kSuccess;
 }
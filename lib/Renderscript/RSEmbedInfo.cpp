@@ -51,20 +51,28 @@ private:
   llvm::Module *M;
   llvm::LLVMContext *C;
 
+  // Metadata of the script extracted by the driver, or NULL to extract it
+  // from the module.
+  const bcinfo::MetadataExtractor *mMetadata;
+
 public:
-  RSEmbedInfoPass()
+  RSEmbedInfoPass(const bcinfo::MetadataExtractor *pMetadata)
       : ModulePass(ID),
-        M(NULL) {
+        M(NULL), mMetadata(pMetadata) {
   }
 
   static std::string getRSInfoString(const llvm::Module *module) {
-    std::string str;
-    llvm::raw_string_ostream s(str);
     bcinfo::MetadataExtractor me(module);
     if (!me.extract()) {
       bccAssert(false && "Could not extract RS metadata for module!");
       return std::string("");
     }
+    return getRSInfoString(me);
+  }
+
+  static std::string getRSInfoString(const bcinfo::MetadataExtractor &me) {
+    std::string str;
+    llvm::raw_string_ostream s(str);
 
     size_t exportVarCount = me.getExportVarCount();
     size_t exportFuncCount = me.getExportFuncCount();
@@ -116,8 +124,9 @@ public:
 
     // Embed this as the global variable .rs.info so that it will be
     // accessible from the shared object later.
-    llvm::Constant *Init = llvm::ConstantDataArray::getString(*C,
-                                                              getRSInfoString(&M));
+    std::string Info = (mMetadata != NULL) ? getRSInfoString(*mMetadata)
+                                           : getRSInfoString(&M);
+    llvm::Constant *Init = llvm::ConstantDataArray::getString(*C, Info);
     llvm::GlobalVariable *InfoGV =
         new llvm::GlobalVariable(M, Init->getType(), true,
                                  llvm::GlobalValue::ExternalLinkage, Init,
@@ -140,8 +149,8 @@ char RSEmbedInfoPass::ID = 0;
 namespace bcc {
 
 llvm::ModulePass *
-createRSEmbedInfoPass() {
-  return new RSEmbedInfoPass();
+createRSEmbedInfoPass(const bcinfo::MetadataExtractor *pMetadata) {
+  return new RSEmbedInfoPass(pMetadata);
 }
 
 }  // end namespace bcc
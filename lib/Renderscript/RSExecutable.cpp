@@ -27,11 +27,57 @@
 
 using namespace bcc;
 
+namespace {
+
+// Return the address of the export at pIdx in the export symbol list of the
+// RSInfo. Only look up pName (followed by pSuffix) in the symbol table of the
+// object if the info doesn't know where the export is, and never if it knows
+// that the object doesn't define it.
+void *getExportAddress(const ObjectLoader &pLoader,
+                       const RSInfo::ExportSymbolListTy &pSymbols, size_t pIdx,
+                       const char *pName, const char *pSuffix = NULL) {
+  if (pIdx < pSymbols.size()) {
+    if (pSymbols[pIdx].section == RSINFO_ABSENT_SECTION) {
+      return NULL;
+    }
+    if (pSymbols[pIdx].section != 0) {
+      uint8_t *base = reinterpret_cast<uint8_t *>(
+          pLoader.getSectionAddress(pSymbols[pIdx].section));
+      if (base != NULL) {
+        return base + pSymbols[pIdx].offset;
+      }
+    }
+  }
+
+  if (pSuffix == NULL) {
+    return pLoader.getSymbolAddress(pName);
+  }
+
+  android::String8 name(pName);
+  name.append(pSuffix);
+  return pLoader.getSymbolAddress(name.string());
+}
+
+// Address of the export functions and foreach functions left out of the usage
+// manifest in the address vectors of RSExecutable. Calling one fails with an
+// error instead of jumping to NULL.
+void absentExport() {
+  LOG_ALWAYS_FATAL("Called a RS export function or kernel which was not "
+                   "listed in the usage manifest and has not been compiled!");
+}
+
+inline void *getAbsentExportAddress() {
+  return reinterpret_cast<void *>(&absentExport);
+}
+
+} // end anonymous namespace
+
 const char *RSExecutable::SpecialFunctionNames[] = {
   "root",      // Graphics drawing function or compute kernel.
   "init",      // Initialization routine called implicitly on startup.
   ".rs.dtor",  // Static global destructor for a script instance.
   ".rs.info",  // Variable containing string of RS metadata info.
+  ".rs.kernel_stats",  // Statistics of the instrumented kernels.
   NULL         // Must be NULL-terminated.
 };
 
@@ -57,6 +103,17 @@ RSExecutable *RSExecutable::Create(RSInfo &pInfo,
     return NULL;
   }
 
+  // Where the exports are in the object, if the info recorded them (see
+  // rsinfo::ExportSymbolItem for the order of the entries.)
+  const RSInfo::ExportSymbolListTy &export_symbols = pInfo.getExportSymbols();
+  const size_t export_func_base = pInfo.getExportVarNames().size();
+  const size_t export_foreach_base = export_func_base +
+                                     pInfo.getExportFuncNames().size();
+  const size_t export_foreach_count = pInfo.getExportForeachFuncs().size();
+  const size_t export_spans_base = export_foreach_base + export_foreach_count;
+  const size_t export_indexed_base = export_spans_base + export_foreach_count;
+  const size_t export_wide_base = export_indexed_base + export_foreach_count;
+
   unsigned idx;
   // Resolve addresses of RS export vars.
   idx = 0;
@@ -67,7 +124,7 @@ RSExecutable *RSExecutable::Create(RSInfo &pInfo,
            var_end = export_var_names.end(); var_iter != var_end;
        var_iter++, idx++) {
     const char *name = *var_iter;
-    void *addr = result->getSymbolAddress(name);
+    void *addr = getExportAddress(*loader, export_symbols, idx, name);
     if (addr == NULL) {
         //ALOGW("RS export var at entry #%u named %s cannot be found in the result "
         //"object!", idx, name);
@@ -84,7 +141,12 @@ RSExecutable *RSExecutable::Create(RSInfo &pInfo,
            func_end = export_func_names.end(); func_iter != func_end;
        func_iter++, idx++) {
     const char *name = *func_iter;
-    void *addr = result->getSymbolAddress(name);
+    if (pInfo.isExportFuncAbsent(idx)) {
+      result->mExportFuncAddrs.push_back(getAbsentExportAddress());
+      continue;
+    }
+    void *addr = getExportAddress(*loader, export_symbols,
+                                  export_func_base + idx, name);
     if (addr == NULL) {
         //      ALOGW("RS export func at entry #%u named %s cannot be found in the result"
         //" object!", idx, name);
@@ -101,19 +163,48 @@ RSExecutable *RSExecutable::Create(RSInfo &pInfo,
            foreach_end = export_foreach_funcs.end();
        foreach_iter != foreach_end; foreach_iter++, idx++) {
     const char *func_name = foreach_iter->first;
-    android::String8 expanded_func_name(func_name);
-    expanded_func_name.append(".expand");
-    void *addr = result->getSymbolAddress(expanded_func_name.string());
+    if (pInfo.isExportForeachFuncAbsent(idx)) {
+      result->mExportForeachFuncAddrs.push_back(getAbsentExportAddress());
+      result->mExportForeachSpansFuncAddrs.push_back(NULL);
+      result->mExportForeachIndexedFuncAddrs.push_back(NULL);
+      result->mExportForeachWideFuncAddrs.push_back(NULL);
+      continue;
+    }
+    void *addr = getExportAddress(*loader, export_symbols,
+                                  export_foreach_base + idx, func_name,
+                                  ".expand");
     if (addr == NULL) {
-        //      ALOGW("Expanded RS foreach at entry #%u named %s cannot be found in the "
-        //            "result object!", idx, expanded_func_name.string());
+        //      ALOGW("Expanded RS foreach at entry #%u named %s.expand cannot be found in the "
+        //            "result object!", idx, func_name);
     }
     result->mExportForeachFuncAddrs.push_back(addr);
+
+    // Only kernels with at most one input have span and indexed entry
+    // points.
+    result->mExportForeachSpansFuncAddrs.push_back(
+        getExportAddress(*loader, export_symbols, export_spans_base + idx,
+                         func_name, ".expand_spans"));
+    result->mExportForeachIndexedFuncAddrs.push_back(
+        getExportAddress(*loader, export_symbols, export_indexed_base + idx,
+                         func_name, ".expand_indexed"));
+
+    void *wide_addr = NULL;
+    if (pInfo.hasWideOffsetKernels()) {
+      wide_addr = getExportAddress(*loader, export_symbols,
+                                   export_wide_base + idx, func_name,
+                                   ".expand64");
+    }
+    result->mExportForeachWideFuncAddrs.push_back(wide_addr);
   }
 
+  result->mKernelStats = reinterpret_cast<RSKernelStats *>(
+      result->getSymbolAddress(".rs.kernel_stats"));
+
   // Copy pragma key/value pairs from RSInfo::getPragmas() into mPragmaKeys and
   // mPragmaValues, respectively.
   const RSInfo::PragmaListTy &pragmas = pInfo.getPragmas();
+  result->mPragmaKeys.setCapacity(pragmas.size());
+  result->mPragmaValues.setCapacity(pragmas.size());
   for (RSInfo::PragmaListTy::const_iterator pragma_iter = pragmas.begin(),
           pragma_end = pragmas.end(); pragma_iter != pragma_end;
        pragma_iter++){
@@ -124,31 +215,57 @@ RSExecutable *RSExecutable::Create(RSInfo &pInfo,
   return result;
 }
 
+void *RSExecutable::getExportFuncAddr(size_t pIdx) const {
+  if (pIdx >= mExportFuncAddrs.size()) {
+    ALOGE("Invalid RS export func index %u!", static_cast<unsigned>(pIdx));
+    return NULL;
+  }
+
+  if (mInfo->isExportFuncAbsent(pIdx)) {
+    ALOGE("RS export func #%u named %s was not listed in the usage manifest "
+          "and has not been compiled!", static_cast<unsigned>(pIdx),
+          mInfo->getExportFuncNames()[pIdx]);
+    return NULL;
+  }
+
+  return mExportFuncAddrs[pIdx];
+}
+
+void *RSExecutable::getExportForeachFuncAddr(size_t pIdx) const {
+  if (pIdx >= mExportForeachFuncAddrs.size()) {
+    ALOGE("Invalid RS foreach index %u!", static_cast<unsigned>(pIdx));
+    return NULL;
+  }
+
+  if (mInfo->isExportForeachFuncAbsent(pIdx)) {
+    ALOGE("RS foreach #%u named %s was not listed in the usage manifest and "
+          "has not been compiled!", static_cast<unsigned>(pIdx),
+          mInfo->getExportForeachFuncs()[pIdx].first);
+    return NULL;
+  }
+
+  return mExportForeachFuncAddrs[pIdx];
+}
+
 bool RSExecutable::syncInfo(bool pForce) {
   if (!pForce && !mIsInfoDirty) {
     return true;
   }
 
   android::String8 info_path = RSInfo::GetPath(mObjFile->getName().c_str());
-  OutputFile info_file(info_path.string(), FileBase::kTruncate);
-
-  if (info_file.hasError()) {
-    ALOGE("Failed to open the info file %s for write! (%s)", info_path.string(),
-          info_file.getErrorMessage().c_str());
-    return false;
-  }
 
   // Operation to the RS info file need to acquire the lock on the output file
   // first.
   if (!mObjFile->lock(FileBase::kWriteLock)) {
     ALOGE("Write to RS info file %s required the acquisition of the write lock "
           "on %s but got failure! (%s)", info_path.string(),
-          mObjFile->getName().c_str(), info_file.getErrorMessage().c_str());
+          mObjFile->getName().c_str(), mObjFile->getErrorMessage().c_str());
     return false;
   }
 
-  // Perform the write.
-  if (!mInfo->write(info_file)) {
+  // Perform the write. mInfo may have been read from info_path and still use
+  // its mapping, so the file is replaced rather than truncated.
+  if (!mInfo->writeFile(info_path.string())) {
     ALOGE("Failed to sync the RS info file %s!", info_path.string());
     mObjFile->unlock();
     return false;
@@ -159,6 +276,27 @@ bool RSExecutable::syncInfo(bool pForce) {
   return true;
 }
 
+void RSExecutable::dumpKernelStats() const {
+  if (mKernelStats == NULL) {
+    ALOGI("%s was not compiled with kernel statistics.",
+          mObjFile->getName().c_str());
+    return;
+  }
+
+  const RSInfo::ExportForeachFuncListTy &foreach_funcs =
+      mInfo->getExportForeachFuncs();
+  for (size_t i = 0, e = foreach_funcs.size(); i != e; i++) {
+    // The counters are updated concurrently by the worker threads, so these
+    // are only a snapshot.
+    const RSKernelStats &stats = mKernelStats[i];
+    ALOGI("%s: invocations: %llu, elements: %llu, cycles: %llu",
+          foreach_funcs[i].first,
+          static_cast<unsigned long long>(stats.invocations),
+          static_cast<unsigned long long>(stats.elements),
+          static_cast<unsigned long long>(stats.cycles));
+  }
+}
+
 void RSExecutable::dumpDisassembly(OutputFile &pOutput) const {
 #if DEBUG_MC_DISASSEMBLER
   if (pOutput.hasError()) {
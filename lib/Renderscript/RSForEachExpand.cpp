@@ -18,11 +18,19 @@
 #include "bcc/Renderscript/RSTransforms.h"
 
 #include <cstdlib>
+#include <cstring>
+#include <map>
+#include <new>
+#include <set>
+#include <string>
 
+#include <llvm/IR/Constants.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
 #include <llvm/Pass.h>
@@ -44,14 +52,23 @@ using namespace bcc;
 namespace {
 
 static const bool gEnableRsTbaa = true;
+static const bool gEnableRsLoopVersioning = true;
+
+// Distance in elements used to prefetch the inputs of the kernels marked with
+// "#pragma rs_prefetch(<kernel>)" when neither the pass nor the pragma gives
+// one.
+static const unsigned gDefaultPrefetchDistance = 16;
 
 /* RSForEachExpandPass - This pass operates on functions that are able to be
  * called via rsForEach() or "foreach_<NAME>". We create an inner loop for the
  * ForEach-able function to be invoked over the appropriate data cells of the
  * input/output allocations (adjusting other relevant parameters as we go). We
  * support doing this for any ForEach-able compute kernels. The new function
- * name is the original function name followed by ".expand". Note that we
- * still generate code for the original function.
+ * name is the original function name followed by ".expand". Kernels with
+ * at most one input also get a "<NAME>.expand_spans" entry point processing
+ * several spans at once, and a "<NAME>.expand_indexed" one processing a list
+ * of coordinates. Note that we still generate code for the original
+ * function.
  */
 class RSForEachExpandPass : public llvm::ModulePass {
 private:
@@ -68,6 +85,16 @@ private:
   llvm::StructType   *ForEachStubType;
   llvm::FunctionType *ExpandedFunctionType;
 
+  /*
+   * Type of the spans processed by the "<NAME>.expand_spans" entry points,
+   * and the signature of these entry points.
+   */
+  llvm::StructType   *ExpandSpanType;
+  llvm::FunctionType *ExpandedSpansFunctionType;
+
+  // Signature of the "<NAME>.expand_indexed" entry points.
+  llvm::FunctionType *ExpandedIndexedFunctionType;
+
   uint32_t mExportForEachCount;
   const char **mExportForEachNameList;
   const uint32_t *mExportForEachSignatureList;
@@ -75,6 +102,30 @@ private:
   // Turns on optimization of allocation stride values.
   bool mEnableStepOpt;
 
+  // Distance in elements to prefetch the inputs of all kernels at, or 0 to
+  // prefetch only for the kernels that ask for it.
+  unsigned mPrefetchDistance;
+
+  // Use non-temporal stores for the output of all kernels.
+  bool mEnableNonTemporalStores;
+
+  // Also create the "<NAME>.expand64" variant of the kernels, computing the
+  // offsets of the elements in 64 bits. Only honored on 64-bit targets.
+  bool mEnableWideOffsets;
+
+  // Instrumentation of the expanded kernels.
+  RSKernelStatsMode mKernelStatsMode;
+
+  // Metadata of the script extracted by the driver, or NULL to extract it
+  // from the module.
+  const bcinfo::MetadataExtractor *mMetadata;
+
+  // Kernels marked with "#pragma rs_prefetch(<kernel>[, <distance>])", with
+  // their prefetch distance, and kernels marked with
+  // "#pragma rs_nontemporal(<kernel>)".
+  std::map<std::string, unsigned> mPrefetchKernels;
+  std::set<std::string> mNonTemporalKernels;
+
   uint32_t getRootSignature(llvm::Function *Function) {
     const llvm::NamedMDNode *ExportForEachMetadata =
         Module->getNamedMetadata("#rs_export_foreach");
@@ -202,20 +253,71 @@ private:
     ExpandedFunctionType = llvm::FunctionType::get(llvm::Type::getVoidTy(*Context),
                                               ParamTypes,
                                               false);
+
+    // Create the RsExpandSpan struct.
+
+    /*
+     * struct RsExpandSpan {
+     *   const void *in;   // Address of the input element (x1, y).
+     *   void *out;        // Address of the output element (x1, y).
+     *   uint32_t y;
+     *   uint32_t x1;
+     *   uint32_t x2;
+     * };
+     */
+    llvm::SmallVector<llvm::Type*, 8> SpanTypes;
+    SpanTypes.push_back(VoidPtrTy);  // const void *in
+    SpanTypes.push_back(VoidPtrTy);  // void *out
+    SpanTypes.push_back(Int32Ty);    // uint32_t y
+    SpanTypes.push_back(Int32Ty);    // uint32_t x1
+    SpanTypes.push_back(Int32Ty);    // uint32_t x2
+
+    ExpandSpanType = llvm::StructType::create(SpanTypes, "RsExpandSpan");
+
+    // Create the function type for the span entry points of expanded kernels.
+
+    llvm::SmallVector<llvm::Type*, 8> SpansParamTypes;
+    SpansParamTypes.push_back(ForEachStubPtrTy); // const RsForEachStubParamStruct *p
+    SpansParamTypes.push_back(ExpandSpanType->getPointerTo()); // const RsExpandSpan *spans
+    SpansParamTypes.push_back(Int32Ty);          // uint32_t count
+    SpansParamTypes.push_back(Int32Ty);          // uint32_t instep
+    SpansParamTypes.push_back(Int32Ty);          // uint32_t outstep
+
+    ExpandedSpansFunctionType =
+        llvm::FunctionType::get(llvm::Type::getVoidTy(*Context),
+                                SpansParamTypes, false);
+
+    // Create the function type for the indexed entry points of expanded
+    // kernels.
+
+    llvm::SmallVector<llvm::Type*, 8> IndexedParamTypes;
+    IndexedParamTypes.push_back(ForEachStubPtrTy); // const RsForEachStubParamStruct *p
+    IndexedParamTypes.push_back(Int32Ty->getPointerTo()); // const uint32_t *coords
+    IndexedParamTypes.push_back(Int32Ty);          // uint32_t count
+    IndexedParamTypes.push_back(Int32Ty);          // uint32_t instep
+    IndexedParamTypes.push_back(Int32Ty);          // uint32_t outstep
+    IndexedParamTypes.push_back(Int32Ty);          // uint32_t in_ystride
+    IndexedParamTypes.push_back(Int32Ty);          // uint32_t out_ystride
+
+    ExpandedIndexedFunctionType =
+        llvm::FunctionType::get(llvm::Type::getVoidTy(*Context),
+                                IndexedParamTypes, false);
   }
 
   /// @brief Create skeleton of the expanded function.
   ///
-  /// This creates a function with the following signature:
+  /// This creates a function named OldName followed by Suffix with the
+  /// following signature:
   ///
   ///   void (const RsForEachStubParamStruct *p, uint32_t x1, uint32_t x2,
   ///         uint32_t instep, uint32_t outstep)
   ///
-  llvm::Function *createEmptyExpandedFunction(llvm::StringRef OldName) {
+  llvm::Function *createEmptyExpandedFunction(llvm::StringRef OldName,
+                                              const char *Suffix = ".expand") {
     llvm::Function *ExpandedFunction =
       llvm::Function::Create(ExpandedFunctionType,
                              llvm::GlobalValue::ExternalLinkage,
-                             OldName + ".expand", Module);
+                             OldName + Suffix, Module);
 
     bccAssert(ExpandedFunction->arg_size() == NUM_EXPANDED_FUNCTION_PARAMS);
 
@@ -235,6 +337,71 @@ private:
     return ExpandedFunction;
   }
 
+  /// @brief Create skeleton of the span entry point of an expanded kernel.
+  ///
+  /// This creates a function with the following signature:
+  ///
+  ///   void (const RsForEachStubParamStruct *p, const RsExpandSpan *spans,
+  ///         uint32_t count, uint32_t instep, uint32_t outstep)
+  ///
+  llvm::Function *createEmptyExpandedSpansFunction(llvm::StringRef OldName) {
+    llvm::Function *ExpandedFunction =
+      llvm::Function::Create(ExpandedSpansFunctionType,
+                             llvm::GlobalValue::ExternalLinkage,
+                             OldName + ".expand_spans", Module);
+
+    bccAssert(ExpandedFunction->arg_size() == NUM_EXPANDED_FUNCTION_PARAMS);
+
+    llvm::Function::arg_iterator AI = ExpandedFunction->arg_begin();
+
+    (AI++)->setName("p");
+    (AI++)->setName("spans");
+    (AI++)->setName("count");
+    (AI++)->setName("arg_instep");
+    (AI++)->setName("arg_outstep");
+
+    llvm::BasicBlock *Begin = llvm::BasicBlock::Create(*Context, "Begin",
+                                                       ExpandedFunction);
+    llvm::IRBuilder<> Builder(Begin);
+    Builder.CreateRetVoid();
+
+    return ExpandedFunction;
+  }
+
+  /// @brief Create skeleton of the indexed entry point of an expanded kernel.
+  ///
+  /// This creates a function with the following signature:
+  ///
+  ///   void (const RsForEachStubParamStruct *p, const uint32_t *coords,
+  ///         uint32_t count, uint32_t instep, uint32_t outstep,
+  ///         uint32_t in_ystride, uint32_t out_ystride)
+  ///
+  llvm::Function *createEmptyExpandedIndexedFunction(llvm::StringRef OldName) {
+    llvm::Function *ExpandedFunction =
+      llvm::Function::Create(ExpandedIndexedFunctionType,
+                             llvm::GlobalValue::ExternalLinkage,
+                             OldName + ".expand_indexed", Module);
+
+    bccAssert(ExpandedFunction->arg_size() == 7);
+
+    llvm::Function::arg_iterator AI = ExpandedFunction->arg_begin();
+
+    (AI++)->setName("p");
+    (AI++)->setName("coords");
+    (AI++)->setName("count");
+    (AI++)->setName("arg_instep");
+    (AI++)->setName("arg_outstep");
+    (AI++)->setName("in_ystride");
+    (AI++)->setName("out_ystride");
+
+    llvm::BasicBlock *Begin = llvm::BasicBlock::Create(*Context, "Begin",
+                                                       ExpandedFunction);
+    llvm::IRBuilder<> Builder(Begin);
+    Builder.CreateRetVoid();
+
+    return ExpandedFunction;
+  }
+
   /// @brief Create an empty loop
   ///
   /// Create a loop of the form:
@@ -295,9 +462,15 @@ private:
   }
 
 public:
-  RSForEachExpandPass(bool pEnableStepOpt)
+  RSForEachExpandPass(bool pEnableStepOpt, unsigned pPrefetchDistance,
+                      bool pEnableNonTemporalStores, bool pEnableWideOffsets,
+                      RSKernelStatsMode pKernelStatsMode,
+                      const bcinfo::MetadataExtractor *pMetadata)
       : ModulePass(ID), Module(NULL), Context(NULL),
-        mEnableStepOpt(pEnableStepOpt) {
+        mEnableStepOpt(pEnableStepOpt), mPrefetchDistance(pPrefetchDistance),
+        mEnableNonTemporalStores(pEnableNonTemporalStores),
+        mEnableWideOffsets(pEnableWideOffsets),
+        mKernelStatsMode(pKernelStatsMode), mMetadata(pMetadata) {
 
   }
 
@@ -443,17 +616,241 @@ public:
     return true;
   }
 
+  /// @brief Loop-invariant values used by the body of an expanded kernel.
+  struct KernelLoopState {
+    llvm::Function *Function;
+    uint32_t Signature;
+
+    llvm::Value *Y;
+
+    llvm::Type  *OutTy;
+    llvm::Value *OutStep;
+    llvm::Value *OutBasePtr;
+    bool PassOutByReference;
+
+    // Prefetch the inputs this many elements ahead (0 to disable).
+    unsigned PrefetchDistance;
+    // Store the output with non-temporal stores.
+    bool NonTemporalStore;
+    // Type in which the byte offsets of the elements are computed, or NULL to
+    // compute them in 32 bits.
+    llvm::Type *OffsetTy;
+
+    llvm::SmallVector<llvm::Type*,  8> InTypes;
+    llvm::SmallVector<llvm::Value*, 8> InSteps;
+    llvm::SmallVector<llvm::Value*, 8> InBasePtrs;
+    llvm::SmallVector<bool,         8> InIsStructPointer;
+  };
+
+  /// @brief Extend the 32-bit unsigned value V to the offset type of State.
+  llvm::Value *widenOffset(llvm::IRBuilder<> &Builder,
+                           const KernelLoopState &State, llvm::Value *V) {
+    if (State.OffsetTy == NULL) {
+      return V;
+    }
+    return Builder.CreateZExt(V, State.OffsetTy);
+  }
+
+  /// @brief Emit the call to the kernel for the element at index IV.
+  ///
+  /// The input and output pointers are computed relative to the element at
+  /// index X1, whose address is given by the base pointers in State. Loads
+  /// from the inputs are annotated with TBAAIn and the store to the output
+  /// with TBAAOut.
+  void emitKernelCall(llvm::IRBuilder<> &Builder, const KernelLoopState &State,
+                      llvm::Value *IV, llvm::Value *X1,
+                      llvm::MDNode *TBAAIn, llvm::MDNode *TBAAOut) {
+    // Populate the actual call to kernel().
+    llvm::SmallVector<llvm::Value*, 8> RootArgs;
+
+    // Calculate the current input and output pointers
+    //
+    //
+    // We always calculate the input/output pointers with a GEP operating on i8
+    // values combined with a multiplication and only cast at the very end to
+    // OutTy.  This is to account for dynamic stepping sizes when the value
+    // isn't apparent at compile time.  In the (very common) case when we know
+    // the step size at compile time, due to haveing complete type information
+    // this multiplication will optmized out and produces code equivalent to a
+    // a GEP on a pointer of the correct type.
+
+    // Output
+
+    llvm::Value *OutPtr = NULL;
+    if (State.OutBasePtr) {
+      llvm::Value *OutOffset = widenOffset(Builder, State,
+                                           Builder.CreateSub(IV, X1));
+
+      OutOffset = Builder.CreateMul(OutOffset,
+                                    widenOffset(Builder, State, State.OutStep));
+      OutPtr    = Builder.CreateGEP(State.OutBasePtr, OutOffset);
+      OutPtr    = Builder.CreatePointerCast(OutPtr, State.OutTy);
+
+      if (State.PassOutByReference) {
+        RootArgs.push_back(OutPtr);
+      }
+    }
+
+    // Inputs
+
+    size_t NumInputs = State.InBasePtrs.size();
+    if (NumInputs > 0) {
+      llvm::Value *Offset = widenOffset(Builder, State,
+                                        Builder.CreateSub(IV, X1));
+
+      // Prefetching past the end of an allocation is harmless since prefetches
+      // never fault.
+      if (State.PrefetchDistance > 0) {
+        llvm::Function *Prefetch =
+            llvm::Intrinsic::getDeclaration(Module, llvm::Intrinsic::prefetch);
+        llvm::Value *PrefetchOffset = Builder.CreateAdd(Offset,
+            llvm::ConstantInt::get(Offset->getType(), State.PrefetchDistance));
+
+        for (size_t Index = 0; Index < NumInputs; ++Index) {
+          llvm::Value *Addr = Builder.CreateGEP(
+              State.InBasePtrs[Index],
+              Builder.CreateMul(PrefetchOffset,
+                  widenOffset(Builder, State, State.InSteps[Index])));
+          // Read, no temporal locality, data cache.
+          Builder.CreateCall4(Prefetch, Addr, Builder.getInt32(0),
+                              Builder.getInt32(0), Builder.getInt32(1));
+        }
+      }
+
+      for (size_t Index = 0; Index < NumInputs; ++Index) {
+        llvm::Value *InOffset = Builder.CreateMul(Offset,
+            widenOffset(Builder, State, State.InSteps[Index]));
+        llvm::Value *InPtr    = Builder.CreateGEP(State.InBasePtrs[Index],
+                                                  InOffset);
+
+        InPtr = Builder.CreatePointerCast(InPtr, State.InTypes[Index]);
+
+        llvm::Value *Input;
+
+        if (State.InIsStructPointer[Index]) {
+          Input = InPtr;
+
+        } else {
+          llvm::LoadInst *InputLoad = Builder.CreateLoad(InPtr, "input");
+
+          if (gEnableRsTbaa) {
+            InputLoad->setMetadata("tbaa", TBAAIn);
+          }
+
+          Input = InputLoad;
+        }
+
+        RootArgs.push_back(Input);
+      }
+    }
+
+    llvm::Value *X = IV;
+    if (bcinfo::MetadataExtractor::hasForEachSignatureX(State.Signature)) {
+      RootArgs.push_back(X);
+    }
+
+    if (State.Y) {
+      RootArgs.push_back(State.Y);
+    }
+
+    llvm::Value *RetVal = Builder.CreateCall(State.Function, RootArgs);
+
+    if (OutPtr && !State.PassOutByReference) {
+      llvm::StoreInst *Store = Builder.CreateStore(RetVal, OutPtr);
+      if (gEnableRsTbaa) {
+        Store->setMetadata("tbaa", TBAAOut);
+      }
+      // Each element of the output is written exactly once and is not read
+      // back by the kernel, so the store does not need to go through the
+      // cache.
+      if (State.NonTemporalStore) {
+        Store->setMetadata("nontemporal",
+                           llvm::MDNode::get(*Context, Builder.getInt32(1)));
+      }
+    }
+  }
+
+  /// @brief Build the runtime check guarding the versioned loop.
+  ///
+  /// The check succeeds if the range written in the output allocation does
+  /// not overlap the ranges read from any of the inputs, and if all strides
+  /// not known at compile time are equal to the size of the element. On
+  /// success, UnitStride holds the state to use with unit strides.
+  llvm::Value *createVersioningCheck(llvm::IRBuilder<> &Builder,
+                                     llvm::DataLayout &DL,
+                                     const KernelLoopState &State,
+                                     llvm::Value *X1, llvm::Value *X2,
+                                     KernelLoopState &UnitStride) {
+    llvm::Type *IntPtrTy = DL.getIntPtrType(*Context);
+
+    UnitStride = State;
+
+    // Number of elements processed by the loop. It is only meaningful if the
+    // loop is executed at all, i.e. if X1 < X2.
+    llvm::Value *Count = Builder.CreateZExt(Builder.CreateSub(X2, X1),
+                                            IntPtrTy);
+
+    llvm::Value *Cond = Builder.getTrue();
+
+    // Check the stride of the output.
+    uint64_t OutSize = DL.getTypeAllocSize(
+        llvm::cast<llvm::PointerType>(State.OutTy)->getElementType());
+    llvm::Value *OutElementSize = Builder.getInt32(OutSize);
+    if (!llvm::isa<llvm::Constant>(State.OutStep)) {
+      Cond = Builder.CreateAnd(Cond,
+          Builder.CreateICmpEQ(State.OutStep, OutElementSize));
+      UnitStride.OutStep = OutElementSize;
+    }
+
+    llvm::Value *OutBegin = Builder.CreatePtrToInt(State.OutBasePtr, IntPtrTy);
+    llvm::Value *OutEnd = Builder.CreateAdd(OutBegin, Builder.CreateMul(
+        Count, Builder.CreateZExt(State.OutStep, IntPtrTy)));
+
+    for (size_t Index = 0; Index < State.InBasePtrs.size(); ++Index) {
+      llvm::Value *InStep = State.InSteps[Index];
+      uint64_t InSize = DL.getTypeAllocSize(
+          llvm::cast<llvm::PointerType>(State.InTypes[Index])->getElementType());
+      llvm::Value *InElementSize = Builder.getInt32(InSize);
+      if (!llvm::isa<llvm::Constant>(InStep)) {
+        Cond = Builder.CreateAnd(Cond,
+            Builder.CreateICmpEQ(InStep, InElementSize));
+        UnitStride.InSteps[Index] = InElementSize;
+      }
+
+      llvm::Value *InBegin = Builder.CreatePtrToInt(State.InBasePtrs[Index],
+                                                    IntPtrTy);
+      llvm::Value *InEnd = Builder.CreateAdd(InBegin, Builder.CreateMul(
+          Count, Builder.CreateZExt(InStep, IntPtrTy)));
+
+      // (OutEnd <= InBegin) || (InEnd <= OutBegin)
+      llvm::Value *NoOverlap = Builder.CreateOr(
+          Builder.CreateICmpULE(OutEnd, InBegin),
+          Builder.CreateICmpULE(InEnd, OutBegin));
+      Cond = Builder.CreateAnd(Cond, NoOverlap);
+    }
+
+    Cond->setName("versioning_check");
+    return Cond;
+  }
+
   /* Expand a pass-by-value kernel.
+   *
+   * If WideOffsets is true, this creates "<NAME>.expand64" instead, which
+   * computes the byte offsets of the elements in pointer-sized integers so
+   * that allocations larger than 4 GiB can be processed in a single launch.
    */
-  bool ExpandKernel(llvm::Function *Function, uint32_t Signature) {
+  bool ExpandKernel(llvm::Function *Function, uint32_t Signature,
+                    bool WideOffsets = false) {
     bccAssert(bcinfo::MetadataExtractor::hasForEachSignatureKernel(Signature));
-    ALOGV("Expanding kernel Function %s", Function->getName().str().c_str());
+    ALOGV("Expanding kernel Function %s%s", Function->getName().str().c_str(),
+          (WideOffsets ? " with 64-bit offsets" : ""));
 
     // TODO: Refactor this to share functionality with ExpandFunction.
     llvm::DataLayout DL(Module);
 
     llvm::Function *ExpandedFunction =
-      createEmptyExpandedFunction(Function->getName());
+      createEmptyExpandedFunction(Function->getName(),
+                                  (WideOffsets ? ".expand64" : ".expand"));
 
     /*
      * Extract the expanded function's parameters.  It is guaranteed by
@@ -484,6 +881,20 @@ public:
     TBAAPointer = MDHelper.createTBAAScalarTypeNode("pointer", TBAARenderScript);
     TBAAPointer = MDHelper.createTBAAStructTagNode(TBAAPointer, TBAAPointer, 0);
 
+    KernelLoopState State;
+    State.Function = Function;
+    State.Signature = Signature;
+    State.Y = NULL;
+    State.OutTy = NULL;
+    State.OutStep = NULL;
+    State.OutBasePtr = NULL;
+    State.PassOutByReference = false;
+    State.PrefetchDistance = 0;
+    State.NonTemporalStore = false;
+    State.OffsetTy = WideOffsets ? DL.getIntPtrType(*Context) : NULL;
+
+    State.PrefetchDistance = getPrefetchDistance(Function);
+
     /*
      * Collect and construct the arguments for the kernel().
      *
@@ -491,9 +902,8 @@ public:
      */
     size_t NumInputs = Function->arg_size();
 
-    llvm::Value *Y = NULL;
     if (bcinfo::MetadataExtractor::hasForEachSignatureY(Signature)) {
-      Y = Builder.CreateLoad(Builder.CreateStructGEP(Arg_p, 5), "Y");
+      State.Y = Builder.CreateLoad(Builder.CreateStructGEP(Arg_p, 5), "Y");
       --NumInputs;
     }
 
@@ -508,39 +918,30 @@ public:
     llvm::Function::arg_iterator ArgIter = Function->arg_begin();
 
     // Check the return type
-    llvm::Type     *OutTy      = NULL;
-    llvm::Value    *OutStep    = NULL;
-    llvm::LoadInst *OutBasePtr = NULL;
-
-    bool PassOutByReference = false;
-
     if (bcinfo::MetadataExtractor::hasForEachSignatureOut(Signature)) {
       llvm::Type *OutBaseTy = Function->getReturnType();
 
       if (OutBaseTy->isVoidTy()) {
-        PassOutByReference = true;
-        OutTy = ArgIter->getType();
+        State.PassOutByReference = true;
+        State.OutTy = ArgIter->getType();
 
         ArgIter++;
         --NumInputs;
       } else {
         // We don't increment Args, since we are using the actual return type.
-        OutTy = OutBaseTy->getPointerTo();
+        State.OutTy = OutBaseTy->getPointerTo();
       }
 
-      OutStep = getStepValue(&DL, OutTy, Arg_outstep);
-      OutStep->setName("outstep");
-      OutBasePtr = Builder.CreateLoad(Builder.CreateStructGEP(Arg_p, 1));
+      State.OutStep = getStepValue(&DL, State.OutTy, Arg_outstep);
+      State.OutStep->setName("outstep");
+      llvm::LoadInst *OutBasePtr =
+          Builder.CreateLoad(Builder.CreateStructGEP(Arg_p, 1));
       if (gEnableRsTbaa) {
         OutBasePtr->setMetadata("tbaa", TBAAPointer);
       }
+      State.OutBasePtr = OutBasePtr;
     }
 
-    llvm::SmallVector<llvm::Type*,     8> InTypes;
-    llvm::SmallVector<llvm::Value*,    8> InSteps;
-    llvm::SmallVector<llvm::LoadInst*, 8> InBasePtrs;
-    llvm::SmallVector<bool,            8> InIsStructPointer;
-
     if (NumInputs == 1) {
       llvm::Type *InType = ArgIter->getType();
 
@@ -555,9 +956,9 @@ public:
        */
       if (!InType->isPointerTy()) {
         InType = InType->getPointerTo();
-        InIsStructPointer.push_back(false);
+        State.InIsStructPointer.push_back(false);
       } else {
-        InIsStructPointer.push_back(true);
+        State.InIsStructPointer.push_back(true);
       }
 
       llvm::Value *InStep = getStepValue(&DL, InType, Arg_instep);
@@ -571,9 +972,9 @@ public:
         InBasePtr->setMetadata("tbaa", TBAAPointer);
       }
 
-      InTypes.push_back(InType);
-      InSteps.push_back(InStep);
-      InBasePtrs.push_back(InBasePtr);
+      State.InTypes.push_back(InType);
+      State.InSteps.push_back(InStep);
+      State.InBasePtrs.push_back(InBasePtr);
 
     } else if (NumInputs > 1) {
       llvm::Value    *InsMember  = Builder.CreateStructGEP(Arg_p, 10);
@@ -606,9 +1007,9 @@ public:
          */
           if (!InType->isPointerTy()) {
             InType = InType->getPointerTo();
-            InIsStructPointer.push_back(false);
+            State.InIsStructPointer.push_back(false);
           } else {
-            InIsStructPointer.push_back(true);
+            State.InIsStructPointer.push_back(true);
           }
 
           llvm::Value *InStep = getStepValue(&DL, InType, InStepArg);
@@ -623,87 +1024,656 @@ public:
             InBasePtr->setMetadata("tbaa", TBAAPointer);
           }
 
-          InTypes.push_back(InType);
-          InSteps.push_back(InStep);
-          InBasePtrs.push_back(InBasePtr);
+          State.InTypes.push_back(InType);
+          State.InSteps.push_back(InStep);
+          State.InBasePtrs.push_back(InBasePtr);
       }
     }
 
+    if (State.OutBasePtr && !State.PassOutByReference) {
+      State.NonTemporalStore = mEnableNonTemporalStores ||
+          mNonTemporalKernels.count(Function->getName().str());
+    }
+
+    // When the kernel returns its result, the only accesses to the
+    // allocations in the loop are the loads of the inputs and the store of
+    // the output. If a runtime check shows that they do not overlap, branch
+    // to a version of the loop where they are known not to alias each other
+    // and where the strides are the element sizes. This does not depend on
+    // allocPointersExposed(), since the accesses of the version are
+    // annotated with a separate TBAA tree that is never connected to the
+    // C/C++ one.
+    if (gEnableRsLoopVersioning && State.OutBasePtr &&
+        !State.PassOutByReference && NumInputs > 0) {
+      KernelLoopState UnitStride;
+      llvm::Value *Cond = createVersioningCheck(Builder, DL, State,
+                                                Arg_x1, Arg_x2, UnitStride);
+
+      llvm::MDNode *TBAAVersioned, *TBAAVersionedIn, *TBAAVersionedOut;
+      TBAAVersioned = MDHelper.createTBAARoot("RenderScript Versioned TBAA");
+      TBAAVersionedIn = MDHelper.createTBAAScalarTypeNode("input", TBAAVersioned);
+      TBAAVersionedIn = MDHelper.createTBAAStructTagNode(TBAAVersionedIn, TBAAVersionedIn, 0);
+      TBAAVersionedOut = MDHelper.createTBAAScalarTypeNode("output", TBAAVersioned);
+      TBAAVersionedOut = MDHelper.createTBAAStructTagNode(TBAAVersionedOut, TBAAVersionedOut, 0);
+
+      llvm::BasicBlock *CheckBB = Builder.GetInsertBlock();
+      llvm::BasicBlock *ExitBB =
+          llvm::SplitBlock(CheckBB, Builder.GetInsertPoint(), this);
+      llvm::BasicBlock *VersionedBB =
+          llvm::BasicBlock::Create(*Context, "Versioned", ExpandedFunction,
+                                   ExitBB);
+      llvm::BasicBlock *GenericBB =
+          llvm::BasicBlock::Create(*Context, "Generic", ExpandedFunction,
+                                   ExitBB);
+
+      CheckBB->getTerminator()->eraseFromParent();
+      Builder.SetInsertPoint(CheckBB);
+      Builder.CreateCondBr(Cond, VersionedBB, GenericBB);
+
+      llvm::PHINode *IV;
+
+      Builder.SetInsertPoint(VersionedBB);
+      Builder.SetInsertPoint(Builder.CreateBr(ExitBB));
+      createLoop(Builder, Arg_x1, Arg_x2, &IV);
+      emitKernelCall(Builder, UnitStride, IV, Arg_x1,
+                     TBAAVersionedIn, TBAAVersionedOut);
+
+      Builder.SetInsertPoint(GenericBB);
+      Builder.SetInsertPoint(Builder.CreateBr(ExitBB));
+      createLoop(Builder, Arg_x1, Arg_x2, &IV);
+      emitKernelCall(Builder, State, IV, Arg_x1,
+                     TBAAAllocation, TBAAAllocation);
+
+      return true;
+    }
+
     llvm::PHINode *IV;
     createLoop(Builder, Arg_x1, Arg_x2, &IV);
+    emitKernelCall(Builder, State, IV, Arg_x1, TBAAAllocation, TBAAAllocation);
 
-    // Populate the actual call to kernel().
-    llvm::SmallVector<llvm::Value*, 8> RootArgs;
+    return true;
+  }
 
-    // Calculate the current input and output pointers
-    //
-    //
-    // We always calculate the input/output pointers with a GEP operating on i8
-    // values combined with a multiplication and only cast at the very end to
-    // OutTy.  This is to account for dynamic stepping sizes when the value
-    // isn't apparent at compile time.  In the (very common) case when we know
-    // the step size at compile time, due to haveing complete type information
-    // this multiplication will optmized out and produces code equivalent to a
-    // a GEP on a pointer of the correct type.
+  /// @brief Return the number of inputs of a pass-by-value kernel.
+  size_t getKernelInputCount(llvm::Function *Function, uint32_t Signature) {
+    size_t NumInputs = Function->arg_size();
+    if (bcinfo::MetadataExtractor::hasForEachSignatureY(Signature)) {
+      --NumInputs;
+    }
+    if (bcinfo::MetadataExtractor::hasForEachSignatureX(Signature)) {
+      --NumInputs;
+    }
+    if (bcinfo::MetadataExtractor::hasForEachSignatureOut(Signature) &&
+        Function->getReturnType()->isVoidTy()) {
+      --NumInputs;
+    }
+    return NumInputs;
+  }
 
-    // Output
+  /// @brief Set up the state of the loop over a pass-by-value kernel with at
+  /// most one input, except for its base pointers and Y.
+  ///
+  /// The steps are computed from Arg_instep and Arg_outstep.
+  void initSingleInputKernelState(llvm::DataLayout &DL,
+                                  llvm::Function *Function, uint32_t Signature,
+                                  llvm::Value *Arg_instep,
+                                  llvm::Value *Arg_outstep,
+                                  KernelLoopState &State) {
+    State.Function = Function;
+    State.Signature = Signature;
+    State.Y = NULL;
+    State.OutTy = NULL;
+    State.OutStep = NULL;
+    State.OutBasePtr = NULL;
+    State.PassOutByReference = false;
+    State.PrefetchDistance = 0;
+    State.NonTemporalStore = false;
+    State.OffsetTy = NULL;
+
+    State.PrefetchDistance = getPrefetchDistance(Function);
 
-    llvm::Value *OutPtr = NULL;
+    llvm::Function::arg_iterator ArgIter = Function->arg_begin();
+
+    if (bcinfo::MetadataExtractor::hasForEachSignatureOut(Signature)) {
+      llvm::Type *OutBaseTy = Function->getReturnType();
+
+      if (OutBaseTy->isVoidTy()) {
+        State.PassOutByReference = true;
+        State.OutTy = ArgIter->getType();
+        ArgIter++;
+      } else {
+        State.OutTy = OutBaseTy->getPointerTo();
+      }
+
+      State.OutStep = getStepValue(&DL, State.OutTy, Arg_outstep);
+      State.OutStep->setName("outstep");
+      State.NonTemporalStore = !State.PassOutByReference &&
+          (mEnableNonTemporalStores ||
+           mNonTemporalKernels.count(Function->getName().str()));
+    }
+
+    if (getKernelInputCount(Function, Signature) == 1) {
+      // See ExpandKernel() for the handling of struct inputs promoted to
+      // pointers.
+      llvm::Type *InType = ArgIter->getType();
+      if (!InType->isPointerTy()) {
+        InType = InType->getPointerTo();
+        State.InIsStructPointer.push_back(false);
+      } else {
+        State.InIsStructPointer.push_back(true);
+      }
+
+      llvm::Value *InStep = getStepValue(&DL, InType, Arg_instep);
+      InStep->setName("instep");
+
+      State.InTypes.push_back(InType);
+      State.InSteps.push_back(InStep);
+    }
+  }
+
+  /* Create the span entry point of a pass-by-value kernel with at most one
+   * input. "<NAME>.expand_spans" processes an array of (y, x1, x2) spans in a
+   * single call, so that a worker thread can run a whole chunk of work with
+   * one indirect call. The steps, the kernel setup and the TBAA annotations
+   * are shared by all the spans; only the base addresses and the bounds are
+   * read from each span.
+   *
+   * Kernels with several inputs have no span entry point, since their base
+   * addresses live in the ins array of the RsForEachStubParamStruct.
+   */
+  bool ExpandKernelSpans(llvm::Function *Function, uint32_t Signature) {
+    bccAssert(bcinfo::MetadataExtractor::hasForEachSignatureKernel(Signature));
+
+    if (getKernelInputCount(Function, Signature) > 1) {
+      return false;
+    }
+
+    ALOGV("Expanding spans of kernel Function %s",
+          Function->getName().str().c_str());
+
+    llvm::DataLayout DL(Module);
+
+    llvm::Function *ExpandedFunction =
+      createEmptyExpandedSpansFunction(Function->getName());
+
+    llvm::Function::arg_iterator ExpandedFunctionArgIter =
+      ExpandedFunction->arg_begin();
+
+    ExpandedFunctionArgIter++;  // p
+    llvm::Value *Arg_spans   = &*(ExpandedFunctionArgIter++);
+    llvm::Value *Arg_count   = &*(ExpandedFunctionArgIter++);
+    llvm::Value *Arg_instep  = &*(ExpandedFunctionArgIter++);
+    llvm::Value *Arg_outstep = &*ExpandedFunctionArgIter;
+
+    llvm::IRBuilder<> Builder(ExpandedFunction->getEntryBlock().begin());
+
+    // Create TBAA meta-data. See ExpandKernel().
+    llvm::MDNode *TBAARenderScript, *TBAAAllocation, *TBAAPointer;
+    llvm::MDBuilder MDHelper(*Context);
+
+    TBAARenderScript = MDHelper.createTBAARoot("RenderScript TBAA");
+    TBAAAllocation = MDHelper.createTBAAScalarTypeNode("allocation", TBAARenderScript);
+    TBAAAllocation = MDHelper.createTBAAStructTagNode(TBAAAllocation, TBAAAllocation, 0);
+    TBAAPointer = MDHelper.createTBAAScalarTypeNode("pointer", TBAARenderScript);
+    TBAAPointer = MDHelper.createTBAAStructTagNode(TBAAPointer, TBAAPointer, 0);
+
+    KernelLoopState State;
+    initSingleInputKernelState(DL, Function, Signature, Arg_instep,
+                               Arg_outstep, State);
+
+    // for (i = 0; i < count; i++)
+    llvm::PHINode *SpanIndex;
+    createLoop(Builder, Builder.getInt32(0), Arg_count, &SpanIndex);
+
+    llvm::Value *Span = Builder.CreateGEP(Arg_spans, SpanIndex, "span");
+    llvm::Value *X1 = Builder.CreateLoad(Builder.CreateStructGEP(Span, 3),
+                                         "x1");
+    llvm::Value *X2 = Builder.CreateLoad(Builder.CreateStructGEP(Span, 4),
+                                         "x2");
+
+    if (bcinfo::MetadataExtractor::hasForEachSignatureY(Signature)) {
+      State.Y = Builder.CreateLoad(Builder.CreateStructGEP(Span, 2), "Y");
+    }
+
+    if (State.OutTy) {
+      llvm::LoadInst *OutBasePtr =
+          Builder.CreateLoad(Builder.CreateStructGEP(Span, 1));
+      if (gEnableRsTbaa) {
+        OutBasePtr->setMetadata("tbaa", TBAAPointer);
+      }
+      State.OutBasePtr = OutBasePtr;
+    }
+
+    if (!State.InTypes.empty()) {
+      llvm::LoadInst *InBasePtr =
+          Builder.CreateLoad(Builder.CreateStructGEP(Span, 0), "input_base");
+      if (gEnableRsTbaa) {
+        InBasePtr->setMetadata("tbaa", TBAAPointer);
+      }
+      State.InBasePtrs.push_back(InBasePtr);
+    }
+
+    // for (x = x1; x < x2; x++)
+    llvm::PHINode *IV;
+    createLoop(Builder, X1, X2, &IV);
+    emitKernelCall(Builder, State, IV, X1, TBAAAllocation, TBAAAllocation);
+
+    return true;
+  }
+
+  /* Create the indexed entry point of a pass-by-value kernel with at most one
+   * input. "<NAME>.expand_indexed" runs the kernel only over the count
+   * elements whose (x, y) coordinates are listed in coords, so that sparse
+   * launches cost O(active elements) instead of O(allocation). Here p->in and
+   * p->out are the addresses of the element (0, 0) of the allocations, and
+   * the address of the element (x, y) is base + y * ystride + x * step.
+   *
+   * Inputs are not prefetched since the coordinates need not be ordered.
+   */
+  bool ExpandKernelIndexed(llvm::Function *Function, uint32_t Signature) {
+    bccAssert(bcinfo::MetadataExtractor::hasForEachSignatureKernel(Signature));
+
+    if (getKernelInputCount(Function, Signature) > 1) {
+      return false;
+    }
+
+    ALOGV("Expanding indexed kernel Function %s",
+          Function->getName().str().c_str());
+
+    llvm::DataLayout DL(Module);
+
+    llvm::Function *ExpandedFunction =
+      createEmptyExpandedIndexedFunction(Function->getName());
+
+    llvm::Function::arg_iterator ExpandedFunctionArgIter =
+      ExpandedFunction->arg_begin();
+
+    llvm::Value *Arg_p           = &*(ExpandedFunctionArgIter++);
+    llvm::Value *Arg_coords      = &*(ExpandedFunctionArgIter++);
+    llvm::Value *Arg_count       = &*(ExpandedFunctionArgIter++);
+    llvm::Value *Arg_instep      = &*(ExpandedFunctionArgIter++);
+    llvm::Value *Arg_outstep     = &*(ExpandedFunctionArgIter++);
+    llvm::Value *Arg_in_ystride  = &*(ExpandedFunctionArgIter++);
+    llvm::Value *Arg_out_ystride = &*ExpandedFunctionArgIter;
+
+    llvm::IRBuilder<> Builder(ExpandedFunction->getEntryBlock().begin());
+
+    // Create TBAA meta-data. See ExpandKernel().
+    llvm::MDNode *TBAARenderScript, *TBAAAllocation, *TBAAPointer;
+    llvm::MDBuilder MDHelper(*Context);
+
+    TBAARenderScript = MDHelper.createTBAARoot("RenderScript TBAA");
+    TBAAAllocation = MDHelper.createTBAAScalarTypeNode("allocation", TBAARenderScript);
+    TBAAAllocation = MDHelper.createTBAAStructTagNode(TBAAAllocation, TBAAAllocation, 0);
+    TBAAPointer = MDHelper.createTBAAScalarTypeNode("pointer", TBAARenderScript);
+    TBAAPointer = MDHelper.createTBAAStructTagNode(TBAAPointer, TBAAPointer, 0);
+
+    KernelLoopState State;
+    initSingleInputKernelState(DL, Function, Signature, Arg_instep,
+                               Arg_outstep, State);
+    State.PrefetchDistance = 0;
+
+    // The base addresses of the allocations are loop-invariant.
+    llvm::Value *OutBasePtr = NULL;
+    if (State.OutTy) {
+      llvm::LoadInst *OutBase =
+          Builder.CreateLoad(Builder.CreateStructGEP(Arg_p, 1));
+      if (gEnableRsTbaa) {
+        OutBase->setMetadata("tbaa", TBAAPointer);
+      }
+      OutBasePtr = OutBase;
+    }
+
+    llvm::Value *InBasePtr = NULL;
+    if (!State.InTypes.empty()) {
+      llvm::LoadInst *InBase =
+          Builder.CreateLoad(Builder.CreateStructGEP(Arg_p, 0), "input_base");
+      if (gEnableRsTbaa) {
+        InBase->setMetadata("tbaa", TBAAPointer);
+      }
+      InBasePtr = InBase;
+      State.InBasePtrs.push_back(InBasePtr);
+    }
+
+    // The offsets of the rows are relative to the element (0, 0), so they are
+    // computed in pointer-sized integers: in 32 bits they would wrap for
+    // allocations larger than 2 GiB on 64-bit targets. The coordinates and the
+    // strides are unsigned.
+    llvm::Type *IntPtrTy = DL.getIntPtrType(*Context);
+    llvm::Value *OutYStride = Builder.CreateZExt(Arg_out_ystride, IntPtrTy,
+                                                 "out_ystride_wide");
+    llvm::Value *InYStride = Builder.CreateZExt(Arg_in_ystride, IntPtrTy,
+                                                "in_ystride_wide");
+
+    // for (i = 0; i < count; i++)
+    llvm::PHINode *Index;
+    createLoop(Builder, Builder.getInt32(0), Arg_count, &Index);
+
+    llvm::Value *Coord = Builder.CreateGEP(
+        Arg_coords, Builder.CreateShl(Builder.CreateZExt(Index, IntPtrTy), 1));
+    llvm::Value *X = Builder.CreateLoad(Coord, "x");
+    llvm::Value *Y = Builder.CreateLoad(
+        Builder.CreateGEP(Coord, Builder.getInt32(1)), "y");
+
+    if (bcinfo::MetadataExtractor::hasForEachSignatureY(Signature)) {
+      State.Y = Y;
+    }
+
+    // Point the bases at the element (0, y) and let emitKernelCall() add
+    // x * step.
+    llvm::Value *WideY = Builder.CreateZExt(Y, IntPtrTy, "y_wide");
     if (OutBasePtr) {
-      llvm::Value *OutOffset = Builder.CreateSub(IV, Arg_x1);
+      State.OutBasePtr = Builder.CreateGEP(
+          OutBasePtr, Builder.CreateMul(WideY, OutYStride), "out_row");
+    }
 
-      OutOffset = Builder.CreateMul(OutOffset, OutStep);
-      OutPtr    = Builder.CreateGEP(OutBasePtr, OutOffset);
-      OutPtr    = Builder.CreatePointerCast(OutPtr, OutTy);
+    if (InBasePtr) {
+      State.InBasePtrs[0] = Builder.CreateGEP(
+          InBasePtr, Builder.CreateMul(WideY, InYStride), "in_row");
+    }
 
-      if (PassOutByReference) {
-        RootArgs.push_back(OutPtr);
+    emitKernelCall(Builder, State, X, Builder.getInt32(0),
+                   TBAAAllocation, TBAAAllocation);
+
+    return true;
+  }
+
+  /// @brief Create the ".rs.kernel_stats" global holding the statistics of
+  /// each exported ForEach-able function, in the order of the export list.
+  ///
+  /// Each entry is a struct { i64 invocations, i64 elements, i64 cycles }.
+  llvm::GlobalVariable *createKernelStats() {
+    llvm::Type *Int64Ty = llvm::Type::getInt64Ty(*Context);
+    llvm::Type *EntryTypes[] = { Int64Ty, Int64Ty, Int64Ty };
+    llvm::StructType *EntryTy = llvm::StructType::get(*Context, EntryTypes);
+    llvm::ArrayType *StatsTy = llvm::ArrayType::get(EntryTy,
+                                                    mExportForEachCount);
+
+    return new llvm::GlobalVariable(*Module, StatsTy, /* isConstant */false,
+                                    llvm::GlobalValue::ExternalLinkage,
+                                    llvm::ConstantAggregateZero::get(StatsTy),
+                                    ".rs.kernel_stats");
+  }
+
+  /// @brief Entry points of an expanded kernel, which differ in the way they
+  /// receive the elements to process.
+  enum ExpandedEntryKind {
+    // ".expand" and ".expand64": the range [x1, x2).
+    ExpandedRange,
+    // ".expand_spans": an array of count (y, x1, x2) spans.
+    ExpandedSpans,
+    // ".expand_indexed": an array of count (x, y) coordinates.
+    ExpandedIndexed
+  };
+
+  /// @brief Update the entry Slot of Stats each time Expanded is called.
+  ///
+  /// Kind tells which entry point Expanded is, so that every way of launching
+  /// a kernel is counted. The counters are updated with atomic adds since the
+  /// runtime calls the expanded functions from several threads at once.
+  void instrumentExpandedFunction(llvm::Function *Expanded,
+                                  llvm::GlobalVariable *Stats,
+                                  unsigned Slot, ExpandedEntryKind Kind) {
+    llvm::Function::arg_iterator AI = Expanded->arg_begin();
+    AI++;  // p
+
+    llvm::IRBuilder<> Builder(Expanded->getEntryBlock().getFirstInsertionPt());
+    llvm::Type *Int64Ty = Builder.getInt64Ty();
+
+    llvm::Value *Entry = Builder.CreateConstGEP2_32(Stats, 0, Slot);
+
+    // cycles += (cycle counter at exit) - (cycle counter at entry)
+    llvm::Function *ReadCycleCounter = NULL;
+    llvm::Value *Start = NULL;
+    if (mKernelStatsMode == RSKernelStatsCycles) {
+      ReadCycleCounter =
+          llvm::Intrinsic::getDeclaration(Module,
+                                          llvm::Intrinsic::readcyclecounter);
+      Start = Builder.CreateCall(ReadCycleCounter, "start_cycles");
+    }
+
+    // invocations += 1
+    Builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add,
+                            Builder.CreateStructGEP(Entry, 0),
+                            Builder.getInt64(1), llvm::Monotonic);
+
+    switch (Kind) {
+      case ExpandedRange: {
+        llvm::Value *Arg_x1 = &*(AI++);
+        llvm::Value *Arg_x2 = &*AI;
+
+        // elements += (x1 < x2) ? x2 - x1 : 0
+        llvm::Value *NumElements = Builder.CreateSelect(
+            Builder.CreateICmpULT(Arg_x1, Arg_x2),
+            Builder.CreateSub(Arg_x2, Arg_x1), Builder.getInt32(0));
+        Builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add,
+                                Builder.CreateStructGEP(Entry, 1),
+                                Builder.CreateZExt(NumElements, Int64Ty),
+                                llvm::Monotonic);
+        break;
+      }
+      case ExpandedIndexed: {
+        AI++;  // coords
+        llvm::Value *Arg_count = &*AI;
+
+        // elements += count
+        Builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add,
+                                Builder.CreateStructGEP(Entry, 1),
+                                Builder.CreateZExt(Arg_count, Int64Ty),
+                                llvm::Monotonic);
+        break;
+      }
+      case ExpandedSpans: {
+        llvm::Value *Arg_spans = &*(AI++);
+        llvm::Value *Arg_count = &*AI;
+
+        // for (i = 0; i < count; i++)
+        //   elements += (x1 < x2) ? x2 - x1 : 0
+        // One add per span, like ".expand" which is called once per span.
+        llvm::PHINode *SpanIndex;
+        createLoop(Builder, Builder.getInt32(0), Arg_count, &SpanIndex);
+        llvm::Value *Span = Builder.CreateGEP(Arg_spans, SpanIndex);
+        llvm::Value *X1 = Builder.CreateLoad(Builder.CreateStructGEP(Span, 3));
+        llvm::Value *X2 = Builder.CreateLoad(Builder.CreateStructGEP(Span, 4));
+        llvm::Value *NumElements = Builder.CreateSelect(
+            Builder.CreateICmpULT(X1, X2), Builder.CreateSub(X2, X1),
+            Builder.getInt32(0));
+        Builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add,
+                                Builder.CreateStructGEP(Entry, 1),
+                                Builder.CreateZExt(NumElements, Int64Ty),
+                                llvm::Monotonic);
+        break;
       }
     }
 
-    // Inputs
+    if (Start == NULL) {
+      return;
+    }
 
-    if (NumInputs > 0) {
-      llvm::Value *Offset = Builder.CreateSub(IV, Arg_x1);
+    llvm::SmallVector<llvm::ReturnInst*, 4> Returns;
+    for (llvm::Function::iterator BB = Expanded->begin(), BE = Expanded->end();
+         BB != BE; ++BB) {
+      if (llvm::ReturnInst *Ret =
+              llvm::dyn_cast<llvm::ReturnInst>(BB->getTerminator())) {
+        Returns.push_back(Ret);
+      }
+    }
 
-      for (size_t Index = 0; Index < NumInputs; ++Index) {
-        llvm::Value *InOffset = Builder.CreateMul(Offset, InSteps[Index]);
-        llvm::Value *InPtr    = Builder.CreateGEP(InBasePtrs[Index], InOffset);
+    for (size_t i = 0; i < Returns.size(); ++i) {
+      Builder.SetInsertPoint(Returns[i]);
+      llvm::Value *End = Builder.CreateCall(ReadCycleCounter, "end_cycles");
+      Builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add,
+                              Builder.CreateStructGEP(Entry, 2),
+                              Builder.CreateSub(End, Start),
+                              llvm::Monotonic);
+    }
+  }
 
-        InPtr = Builder.CreatePointerCast(InPtr, InTypes[Index]);
+  /// @brief Look up the signature of an exported ForEach-able function.
+  ///
+  /// @return true if Name was found in the export list.
+  bool getExportForEachSignature(llvm::StringRef Name, uint32_t *Signature) {
+    for (size_t i = 0; i < mExportForEachCount; ++i) {
+      if (Name == mExportForEachNameList[i]) {
+        *Signature = mExportForEachSignatureList[i];
+        return true;
+      }
+    }
+    return false;
+  }
 
-        llvm::Value *Input;
+  /* Expand a chain of pass-by-value kernels (A -> B -> C) into a single
+   * function named "<NAME>.expand". The kernels are called back to back for
+   * each element, each one consuming the value returned by its predecessor,
+   * so that intermediate results stay in registers instead of making a round
+   * trip through an allocation. Only the first kernel reads from the input
+   * allocation and only the result of the last kernel is stored to the output
+   * allocation.
+   */
+  bool ExpandFusedKernel(llvm::StringRef Name,
+                         const llvm::SmallVectorImpl<llvm::Function*> &Chain,
+                         const llvm::SmallVectorImpl<uint32_t> &Signatures) {
+    ALOGV("Expanding fused kernel %s", Name.str().c_str());
 
-        if (InIsStructPointer[Index]) {
-          Input = InPtr;
+    bccAssert(Chain.size() == Signatures.size());
+
+    // Check that the chain can be fused before emitting anything. The driver
+    // already did when it declared the fused kernel.
+    if (!canFuseKernels(Name, Chain, Signatures)) {
+      return false;
+    }
 
+    bool UsesY = false;
+    for (size_t i = 0; i < Chain.size(); ++i) {
+      if (bcinfo::MetadataExtractor::hasForEachSignatureY(Signatures[i])) {
+        UsesY = true;
+      }
+    }
+
+    size_t NumInputs = Chain.front()->arg_size();
+    if (bcinfo::MetadataExtractor::hasForEachSignatureX(Signatures.front())) {
+      --NumInputs;
+    }
+    if (bcinfo::MetadataExtractor::hasForEachSignatureY(Signatures.front())) {
+      --NumInputs;
+    }
+
+    llvm::Function *LastKernel = Chain.back();
+    bool HasOut = bcinfo::MetadataExtractor::hasForEachSignatureOut(
+        Signatures.back());
+
+    llvm::DataLayout DL(Module);
+
+    llvm::Function *ExpandedFunction = createEmptyExpandedFunction(Name);
+
+    bccAssert(ExpandedFunction->arg_size() == NUM_EXPANDED_FUNCTION_PARAMS);
+
+    llvm::Function::arg_iterator ExpandedFunctionArgIter =
+      ExpandedFunction->arg_begin();
+
+    llvm::Value *Arg_p       = &*(ExpandedFunctionArgIter++);
+    llvm::Value *Arg_x1      = &*(ExpandedFunctionArgIter++);
+    llvm::Value *Arg_x2      = &*(ExpandedFunctionArgIter++);
+    llvm::Value *Arg_instep  = &*(ExpandedFunctionArgIter++);
+    llvm::Value *Arg_outstep = &*ExpandedFunctionArgIter;
+
+    llvm::IRBuilder<> Builder(ExpandedFunction->getEntryBlock().begin());
+
+    llvm::MDNode *TBAARenderScript, *TBAAAllocation, *TBAAPointer;
+    llvm::MDBuilder MDHelper(*Context);
+
+    TBAARenderScript = MDHelper.createTBAARoot("RenderScript TBAA");
+    TBAAAllocation = MDHelper.createTBAAScalarTypeNode("allocation", TBAARenderScript);
+    TBAAAllocation = MDHelper.createTBAAStructTagNode(TBAAAllocation, TBAAAllocation, 0);
+    TBAAPointer = MDHelper.createTBAAScalarTypeNode("pointer", TBAARenderScript);
+    TBAAPointer = MDHelper.createTBAAStructTagNode(TBAAPointer, TBAAPointer, 0);
+
+    // Load the loop-invariant values before entering the loop.
+    llvm::Value *Y = NULL;
+    if (UsesY) {
+      Y = Builder.CreateLoad(Builder.CreateStructGEP(Arg_p, 5), "Y");
+    }
+
+    llvm::Type     *InTy      = NULL;
+    llvm::Value    *InStep    = NULL;
+    llvm::LoadInst *InBasePtr = NULL;
+    bool InIsStructPointer = false;
+    if (NumInputs == 1) {
+      // See ExpandKernel() for the handling of struct inputs promoted to
+      // pointers.
+      InTy = Chain.front()->arg_begin()->getType();
+      if (!InTy->isPointerTy()) {
+        InTy = InTy->getPointerTo();
+      } else {
+        InIsStructPointer = true;
+      }
+
+      InStep = getStepValue(&DL, InTy, Arg_instep);
+      InStep->setName("instep");
+      InBasePtr = Builder.CreateLoad(Builder.CreateStructGEP(Arg_p, 0),
+                                     "input_base");
+      if (gEnableRsTbaa) {
+        InBasePtr->setMetadata("tbaa", TBAAPointer);
+      }
+    }
+
+    llvm::Type     *OutTy      = NULL;
+    llvm::Value    *OutStep    = NULL;
+    llvm::LoadInst *OutBasePtr = NULL;
+    if (HasOut) {
+      OutTy = LastKernel->getReturnType()->getPointerTo();
+      OutStep = getStepValue(&DL, OutTy, Arg_outstep);
+      OutStep->setName("outstep");
+      OutBasePtr = Builder.CreateLoad(Builder.CreateStructGEP(Arg_p, 1));
+      if (gEnableRsTbaa) {
+        OutBasePtr->setMetadata("tbaa", TBAAPointer);
+      }
+    }
+
+    llvm::PHINode *IV;
+    createLoop(Builder, Arg_x1, Arg_x2, &IV);
+
+    llvm::Value *Offset = Builder.CreateSub(IV, Arg_x1);
+    llvm::Value *Result = NULL;
+
+    for (size_t i = 0; i < Chain.size(); ++i) {
+      llvm::SmallVector<llvm::Value*, 8> KernelArgs;
+
+      if (i > 0) {
+        KernelArgs.push_back(Result);
+      } else if (InBasePtr) {
+        llvm::Value *InPtr = Builder.CreateGEP(InBasePtr,
+                                               Builder.CreateMul(Offset, InStep));
+        InPtr = Builder.CreatePointerCast(InPtr, InTy);
+
+        if (InIsStructPointer) {
+          KernelArgs.push_back(InPtr);
         } else {
           llvm::LoadInst *InputLoad = Builder.CreateLoad(InPtr, "input");
-
           if (gEnableRsTbaa) {
             InputLoad->setMetadata("tbaa", TBAAAllocation);
           }
-
-          Input = InputLoad;
+          KernelArgs.push_back(InputLoad);
         }
+      }
 
-        RootArgs.push_back(Input);
+      if (bcinfo::MetadataExtractor::hasForEachSignatureX(Signatures[i])) {
+        KernelArgs.push_back(IV);
       }
-    }
 
-    llvm::Value *X = IV;
-    if (bcinfo::MetadataExtractor::hasForEachSignatureX(Signature)) {
-      RootArgs.push_back(X);
-    }
+      if (bcinfo::MetadataExtractor::hasForEachSignatureY(Signatures[i])) {
+        KernelArgs.push_back(Y);
+      }
 
-    if (Y) {
-      RootArgs.push_back(Y);
+      Result = Builder.CreateCall(Chain[i], KernelArgs);
     }
 
-    llvm::Value *RetVal = Builder.CreateCall(Function, RootArgs);
+    if (OutBasePtr) {
+      llvm::Value *OutPtr = Builder.CreateGEP(OutBasePtr,
+                                              Builder.CreateMul(Offset, OutStep));
+      OutPtr = Builder.CreatePointerCast(OutPtr, OutTy);
 
-    if (OutPtr && !PassOutByReference) {
-      llvm::StoreInst *Store = Builder.CreateStore(RetVal, OutPtr);
+      llvm::StoreInst *Store = Builder.CreateStore(Result, OutPtr);
       if (gEnableRsTbaa) {
         Store->setMetadata("tbaa", TBAAAllocation);
       }
@@ -712,6 +1682,101 @@ public:
     return true;
   }
 
+  /// @brief Expand the kernel chains declared in "#rs_foreach_fusion".
+  ///
+  /// Each operand of the named metadata is a node of the form
+  /// !{!"<fused name>", !"<kernel 1>", !"<kernel 2>", ...}. The kernels must
+  /// all be exported ForEach-able kernels. They keep their own expanded
+  /// variants.
+  bool expandFusedKernels(llvm::Module &Module) {
+    llvm::NamedMDNode *FusionMetadata =
+        Module.getNamedMetadata("#rs_foreach_fusion");
+    if (!FusionMetadata) {
+      return false;
+    }
+
+    bool Changed = false;
+    for (unsigned i = 0, e = FusionMetadata->getNumOperands(); i != e; ++i) {
+      llvm::MDNode *ChainNode = FusionMetadata->getOperand(i);
+      if (ChainNode == NULL || ChainNode->getNumOperands() < 3) {
+        ALOGE("Malformed kernel fusion metadata (operand %u)", i);
+        continue;
+      }
+
+      llvm::SmallVector<llvm::StringRef, 8> Names;
+      for (unsigned j = 0, je = ChainNode->getNumOperands(); j != je; ++j) {
+        llvm::Value *NameVal = ChainNode->getOperand(j);
+        if (NameVal == NULL ||
+            NameVal->getValueID() != llvm::Value::MDStringVal) {
+          break;
+        }
+        Names.push_back(static_cast<llvm::MDString*>(NameVal)->getString());
+      }
+
+      if (Names.size() != ChainNode->getNumOperands()) {
+        ALOGE("Malformed kernel fusion metadata (operand %u)", i);
+        continue;
+      }
+
+      llvm::SmallVector<llvm::Function*, 8> Chain;
+      llvm::SmallVector<uint32_t, 8> Signatures;
+      for (size_t j = 1; j < Names.size(); ++j) {
+        llvm::Function *Kernel = Module.getFunction(Names[j]);
+        uint32_t Signature = 0;
+        if (Kernel == NULL || !getExportForEachSignature(Names[j], &Signature)) {
+          ALOGE("Cannot fuse '%s': unknown kernel '%s'",
+                Names[0].str().c_str(), Names[j].str().c_str());
+          break;
+        }
+        Chain.push_back(Kernel);
+        Signatures.push_back(Signature);
+      }
+
+      if (Chain.size() + 1 == Names.size()) {
+        Changed |= ExpandFusedKernel(Names[0], Chain, Signatures);
+      }
+    }
+
+    return Changed;
+  }
+
+  /// @brief Records the kernel named by the value of a rs_prefetch pragma.
+  ///
+  /// The value is "<kernel>" or "<kernel>, <distance>", where the distance is
+  /// in elements. Without a (valid) distance, gDefaultPrefetchDistance is
+  /// used.
+  void addPrefetchKernel(llvm::StringRef Value) {
+    std::pair<llvm::StringRef, llvm::StringRef> KernelAndDistance =
+        Value.split(',');
+    llvm::StringRef Kernel = KernelAndDistance.first.trim();
+    llvm::StringRef DistanceStr = KernelAndDistance.second.trim();
+
+    unsigned Distance = gDefaultPrefetchDistance;
+    if (!DistanceStr.empty() && DistanceStr.getAsInteger(10, Distance)) {
+      ALOGW("Invalid prefetch distance '%s' for kernel '%s'! Using %u.",
+            DistanceStr.str().c_str(), Kernel.str().c_str(),
+            gDefaultPrefetchDistance);
+      Distance = gDefaultPrefetchDistance;
+    }
+
+    mPrefetchKernels[Kernel.str()] = Distance;
+  }
+
+  /// @brief Returns the prefetch distance to use in the expanded function of
+  /// the kernel pKernel, or 0 to not prefetch.
+  ///
+  /// A distance given to the pass applies to every kernel and overrides the
+  /// ones of the pragmas.
+  unsigned getPrefetchDistance(const llvm::Function *pKernel) const {
+    if (mPrefetchDistance > 0) {
+      return mPrefetchDistance;
+    }
+
+    std::map<std::string, unsigned>::const_iterator I =
+        mPrefetchKernels.find(pKernel->getName().str());
+    return (I != mPrefetchKernels.end()) ? I->second : 0;
+  }
+
   /// @brief Checks if pointers to allocation internals are exposed
   ///
   /// This function verifies if through the parameters passed to the kernel
@@ -800,17 +1865,42 @@ public:
 
     this->buildTypes();
 
-    bcinfo::MetadataExtractor me(&Module);
-    if (!me.extract()) {
-      ALOGE("Could not extract metadata from module!");
-      return false;
+    // Reuse the metadata already extracted by the driver, if any.
+    bcinfo::MetadataExtractor *OwnMetadata = NULL;
+    const bcinfo::MetadataExtractor *me = mMetadata;
+    if (me == NULL) {
+      OwnMetadata = new (std::nothrow) bcinfo::MetadataExtractor(&Module);
+      if ((OwnMetadata == NULL) || !OwnMetadata->extract()) {
+        ALOGE("Could not extract metadata from module!");
+        delete OwnMetadata;
+        return false;
+      }
+      me = OwnMetadata;
+    }
+    mExportForEachCount = me->getExportForEachSignatureCount();
+    mExportForEachNameList = me->getExportForEachNameList();
+    mExportForEachSignatureList = me->getExportForEachSignatureList();
+
+    mPrefetchKernels.clear();
+    mNonTemporalKernels.clear();
+    const char **PragmaKeys = me->getPragmaKeyList();
+    const char **PragmaValues = me->getPragmaValueList();
+    for (size_t i = 0; i < me->getPragmaCount(); ++i) {
+      if (PragmaKeys[i] == NULL || PragmaValues[i] == NULL) {
+        continue;
+      }
+      if (!strcmp(PragmaKeys[i], "rs_prefetch")) {
+        addPrefetchKernel(PragmaValues[i]);
+      } else if (!strcmp(PragmaKeys[i], "rs_nontemporal")) {
+        mNonTemporalKernels.insert(PragmaValues[i]);
+      }
     }
-    mExportForEachCount = me.getExportForEachSignatureCount();
-    mExportForEachNameList = me.getExportForEachNameList();
-    mExportForEachSignatureList = me.getExportForEachSignatureList();
 
     bool AllocsExposed = allocPointersExposed(Module);
 
+    bool WideOffsets = mEnableWideOffsets &&
+                       (llvm::DataLayout(&Module).getPointerSizeInBits() == 64);
+
     for (size_t i = 0; i < mExportForEachCount; ++i) {
       const char *name = mExportForEachNameList[i];
       uint32_t signature = mExportForEachSignatureList[i];
@@ -818,6 +1908,11 @@ public:
       if (kernel) {
         if (bcinfo::MetadataExtractor::hasForEachSignatureKernel(signature)) {
           Changed |= ExpandKernel(kernel, signature);
+          if (WideOffsets) {
+            Changed |= ExpandKernel(kernel, signature, /* WideOffsets */true);
+          }
+          Changed |= ExpandKernelSpans(kernel, signature);
+          Changed |= ExpandKernelIndexed(kernel, signature);
           kernel->setLinkage(llvm::GlobalValue::InternalLinkage);
         } else if (kernel->getReturnType()->isVoidTy()) {
           Changed |= ExpandFunction(kernel, signature);
@@ -830,10 +1925,37 @@ public:
       }
     }
 
+    Changed |= expandFusedKernels(Module);
+
+    if ((mKernelStatsMode != RSKernelStatsNone) && (mExportForEachCount > 0)) {
+      llvm::GlobalVariable *Stats = createKernelStats();
+      for (size_t i = 0; i < mExportForEachCount; ++i) {
+        llvm::StringRef Name = mExportForEachNameList[i];
+        if (llvm::Function *Expanded =
+                Module.getFunction(Name.str() + ".expand")) {
+          instrumentExpandedFunction(Expanded, Stats, i, ExpandedRange);
+        }
+        if (llvm::Function *Expanded =
+                Module.getFunction(Name.str() + ".expand64")) {
+          instrumentExpandedFunction(Expanded, Stats, i, ExpandedRange);
+        }
+        if (llvm::Function *Expanded =
+                Module.getFunction(Name.str() + ".expand_spans")) {
+          instrumentExpandedFunction(Expanded, Stats, i, ExpandedSpans);
+        }
+        if (llvm::Function *Expanded =
+                Module.getFunction(Name.str() + ".expand_indexed")) {
+          instrumentExpandedFunction(Expanded, Stats, i, ExpandedIndexed);
+        }
+      }
+      Changed = true;
+    }
+
     if (gEnableRsTbaa && !AllocsExposed) {
       connectRenderScriptTBAAMetadata(Module);
     }
 
+    delete OwnMetadata;
     return Changed;
   }
 
@@ -849,9 +1971,76 @@ char RSForEachExpandPass::ID = 0;
 
 namespace bcc {
 
+bool canFuseKernels(llvm::StringRef pFusedName,
+                    llvm::ArrayRef<llvm::Function *> pKernels,
+                    llvm::ArrayRef<uint32_t> pSignatures) {
+  if ((pKernels.size() < 2) || (pKernels.size() != pSignatures.size())) {
+    ALOGE("Cannot fuse '%s': it needs at least two kernels",
+          pFusedName.str().c_str());
+    return false;
+  }
+
+  llvm::Type *PrevRetTy = NULL;
+  for (size_t i = 0; i < pKernels.size(); ++i) {
+    llvm::Function *Kernel = pKernels[i];
+    uint32_t Signature = pSignatures[i];
+    const char *KernelName = Kernel->getName().data();
+
+    if (!bcinfo::MetadataExtractor::hasForEachSignatureKernel(Signature)) {
+      ALOGE("Cannot fuse '%s': '%s' is not a pass-by-value kernel",
+            pFusedName.str().c_str(), KernelName);
+      return false;
+    }
+
+    size_t NumArgs = Kernel->arg_size();
+    if (bcinfo::MetadataExtractor::hasForEachSignatureX(Signature)) {
+      --NumArgs;
+    }
+    if (bcinfo::MetadataExtractor::hasForEachSignatureY(Signature)) {
+      --NumArgs;
+    }
+
+    llvm::Type *RetTy = Kernel->getReturnType();
+    if (i + 1 < pKernels.size() ||
+        bcinfo::MetadataExtractor::hasForEachSignatureOut(Signature)) {
+      // Kernels writing their output through a pointer cannot pass their
+      // result on in a register.
+      if (RetTy->isVoidTy()) {
+        ALOGE("Cannot fuse '%s': '%s' does not return its result",
+              pFusedName.str().c_str(), KernelName);
+        return false;
+      }
+    }
+
+    if (i == 0) {
+      if (NumArgs > 1) {
+        ALOGE("Cannot fuse '%s': '%s' has more than one input",
+              pFusedName.str().c_str(), KernelName);
+        return false;
+      }
+    } else if (NumArgs != 1 || Kernel->arg_begin()->getType() != PrevRetTy) {
+      ALOGE("Cannot fuse '%s': input of '%s' does not match the result of "
+            "'%s'", pFusedName.str().c_str(), KernelName,
+            pKernels[i - 1]->getName().data());
+      return false;
+    }
+
+    PrevRetTy = RetTy;
+  }
+
+  return true;
+}
+
 llvm::ModulePass *
-createRSForEachExpandPass(bool pEnableStepOpt){
-  return new RSForEachExpandPass(pEnableStepOpt);
+createRSForEachExpandPass(bool pEnableStepOpt, unsigned pPrefetchDistance,
+                          bool pEnableNonTemporalStores,
+                          bool pEnableWideOffsets,
+                          RSKernelStatsMode pKernelStatsMode,
+                          const bcinfo::MetadataExtractor *pMetadata){
+  return new RSForEachExpandPass(pEnableStepOpt, pPrefetchDistance,
+                                 pEnableNonTemporalStores,
+                                 pEnableWideOffsets, pKernelStatsMode,
+                                 pMetadata);
 }
 
 } // end namespace bcc
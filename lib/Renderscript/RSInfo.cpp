@@ -25,6 +25,8 @@
 #include <new>
 #include <string>
 
+#include <utils/FileMap.h>
+
 #include "bcc/Support/FileBase.h"
 #include "bcc/Support/Log.h"
 
@@ -88,7 +90,8 @@ bool RSInfo::IsConsistent(const char* pInputFilename, const DependencyHashTy& ex
     return true;
 }
 
-RSInfo::RSInfo(size_t pStringPoolSize) : mStringPool(NULL) {
+RSInfo::RSInfo(size_t pStringPoolSize)
+    : mStringPool(NULL), mFileMap(NULL) {
   ::memset(&mHeader, 0, sizeof(mHeader));
 
   ::memcpy(mHeader.magic, RSINFO_MAGIC, sizeof(mHeader.magic));
@@ -101,6 +104,12 @@ RSInfo::RSInfo(size_t pStringPoolSize) : mStringPool(NULL) {
   mHeader.exportVarNameList.itemSize = sizeof(rsinfo::ExportVarNameItem);
   mHeader.exportFuncNameList.itemSize = sizeof(rsinfo::ExportFuncNameItem);
   mHeader.exportForeachFuncList.itemSize = sizeof(rsinfo::ExportForeachFuncItem);
+  mHeader.absentExportFuncList.itemSize = sizeof(rsinfo::AbsentExportFuncItem);
+  mHeader.absentExportForeachFuncList.itemSize =
+      sizeof(rsinfo::AbsentExportForeachFuncItem);
+  mHeader.exportForeachAnalysisList.itemSize =
+      sizeof(rsinfo::ExportForeachAnalysisItem);
+  mHeader.exportSymbolList.itemSize = sizeof(rsinfo::ExportSymbolItem);
 
   if (pStringPoolSize > 0) {
     mHeader.strPoolSize = pStringPoolSize;
@@ -117,7 +126,12 @@ RSInfo::RSInfo(size_t pStringPoolSize) : mStringPool(NULL) {
 }
 
 RSInfo::~RSInfo() {
-  delete [] mStringPool;
+  if (mFileMap != NULL) {
+    // The string pool belongs to the mapping.
+    mFileMap->release();
+  } else {
+    delete [] mStringPool;
+  }
 }
 
 bool RSInfo::layout(off_t initial_offset) {
@@ -138,6 +152,20 @@ bool RSInfo::layout(off_t initial_offset) {
 
   mHeader.exportForeachFuncList.offset = AFTER(mHeader.exportFuncNameList);
   mHeader.exportForeachFuncList.count = mExportForeachFuncs.size();
+
+  mHeader.absentExportFuncList.offset = AFTER(mHeader.exportForeachFuncList);
+  mHeader.absentExportFuncList.count = mAbsentExportFuncs.size();
+
+  mHeader.absentExportForeachFuncList.offset =
+      AFTER(mHeader.absentExportFuncList);
+  mHeader.absentExportForeachFuncList.count = mAbsentExportForeachFuncs.size();
+
+  mHeader.exportForeachAnalysisList.offset =
+      AFTER(mHeader.absentExportForeachFuncList);
+  mHeader.exportForeachAnalysisList.count = mExportForeachAnalyses.size();
+
+  mHeader.exportSymbolList.offset = AFTER(mHeader.exportForeachAnalysisList);
+  mHeader.exportSymbolList.count = mExportSymbols.size();
 #undef AFTER
 
   return true;
@@ -150,6 +178,8 @@ void RSInfo::dump() const {
   // Dump header
   ALOGV("RSInfo Header:");
   ALOGV("\tIs threadable: %s", ((mHeader.isThreadable) ? "true" : "false"));
+  ALOGV("\tHas 64-bit offset kernels: %s",
+        ((mHeader.hasWideOffsetKernels) ? "true" : "false"));
   ALOGV("\tHeader size: %u", mHeader.headerSize);
   ALOGV("\tString pool size: %u", mHeader.strPoolSize);
 
@@ -201,6 +231,43 @@ void RSInfo::dump() const {
     ALOGV("name: %s, signature: %05x", foreach_iter->first,
                                        foreach_iter->second);
   }
+
+  DUMP_LIST_HEADER("RS absent export functions", mHeader.absentExportFuncList);
+  for (AbsentExportFuncListTy::const_iterator
+          absent_iter = mAbsentExportFuncs.begin(),
+          absent_end = mAbsentExportFuncs.end(); absent_iter != absent_end;
+          absent_iter++) {
+    ALOGV("index: %u", *absent_iter);
+  }
+
+  DUMP_LIST_HEADER("RS absent foreach list",
+                   mHeader.absentExportForeachFuncList);
+  for (AbsentExportForeachFuncListTy::const_iterator
+          absent_iter = mAbsentExportForeachFuncs.begin(),
+          absent_end = mAbsentExportForeachFuncs.end();
+          absent_iter != absent_end; absent_iter++) {
+    ALOGV("index: %u", *absent_iter);
+  }
+
+  DUMP_LIST_HEADER("RS foreach analysis list",
+                   mHeader.exportForeachAnalysisList);
+  for (ExportForeachAnalysisListTy::const_iterator
+          analysis_iter = mExportForeachAnalyses.begin(),
+          analysis_end = mExportForeachAnalyses.end();
+          analysis_iter != analysis_end; analysis_iter++) {
+    ALOGV("threadable: %s, cost per element: %u, min grain size: %u",
+          (analysis_iter->threadable ? "true" : "false"),
+          analysis_iter->costPerElement, analysis_iter->minGrainSize);
+  }
+
+  DUMP_LIST_HEADER("RS export symbol list", mHeader.exportSymbolList);
+  for (ExportSymbolListTy::const_iterator
+          symbol_iter = mExportSymbols.begin(),
+          symbol_end = mExportSymbols.end();
+          symbol_iter != symbol_end; symbol_iter++) {
+    ALOGV("section: %u, offset: 0x%x", symbol_iter->section,
+          symbol_iter->offset);
+  }
 #undef DUMP_LIST_HEADER
 
 #endif // LOG_NDEBUG
@@ -228,6 +295,46 @@ rsinfo::StringIndexTy RSInfo::getStringIdxInPool(const char *pStr) const {
   return (pStr - mStringPool);
 }
 
+bool RSInfo::isExportFuncAbsent(size_t pIdx) const {
+  for (AbsentExportFuncListTy::const_iterator
+          absent_iter = mAbsentExportFuncs.begin(),
+          absent_end = mAbsentExportFuncs.end(); absent_iter != absent_end;
+          absent_iter++) {
+    if (*absent_iter == pIdx) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool RSInfo::isExportForeachFuncAbsent(size_t pIdx) const {
+  for (AbsentExportForeachFuncListTy::const_iterator
+          absent_iter = mAbsentExportForeachFuncs.begin(),
+          absent_end = mAbsentExportForeachFuncs.end();
+          absent_iter != absent_end; absent_iter++) {
+    if (*absent_iter == pIdx) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void RSInfo::applyUsageManifest(const RSUsageManifest &pUsage) {
+  mAbsentExportFuncs.clear();
+  for (size_t i = 0; i < mExportFuncNames.size(); i++) {
+    if (pUsage.invokables.count(mExportFuncNames[i]) == 0) {
+      mAbsentExportFuncs.push(i);
+    }
+  }
+
+  mAbsentExportForeachFuncs.clear();
+  for (size_t i = 0; i < mExportForeachFuncs.size(); i++) {
+    if (pUsage.kernels.count(mExportForeachFuncs[i].first) == 0) {
+      mAbsentExportForeachFuncs.push(i);
+    }
+  }
+}
+
 RSInfo::FloatPrecision RSInfo::getFloatPrecisionRequirement() const {
   // Check to see if we have any FP precision-related pragmas.
   std::string relaxed_pragma("rs_fp_relaxed");
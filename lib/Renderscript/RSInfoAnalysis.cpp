@@ -0,0 +1,367 @@
+/*
+ * Copyright 2014, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//===----------------------------------------------------------------------===//
+// This file implements RSInfo::analyzeForeachFuncs()
+//===----------------------------------------------------------------------===//
+#include "bcc/Renderscript/RSInfo.h"
+
+#include <cctype>
+#include <map>
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/Metadata.h>
+#include <llvm/IR/Module.h>
+
+#include "bcc/Support/Log.h"
+
+using namespace bcc;
+
+namespace {
+
+// Name of metadata node where the chains of fused kernels reside (see
+// RSCompilerDriver::addFusedKernel().)
+const llvm::StringRef foreach_fusion_metadata_name("#rs_foreach_fusion");
+
+// Functions of the Renderscript runtime which must not be called from several
+// threads at once. The graphics functions (rsg*) are matched by their prefix
+// instead.
+const char *serializing_functions[] = {
+  "rsSendToClientBlocking",
+  "rsForEach",
+  NULL
+};
+
+// Estimated cost of the work in a chunk of elements large enough to amortize
+// the cost of scheduling it on a worker thread.
+const uint32_t target_chunk_cost = 16384;
+
+// Per-element cost of the kernels which can't be analyzed.
+const uint32_t unknown_cost = 64;
+
+struct FunctionAnalysis {
+  bool threadable;
+  uint64_t cost;
+};
+
+typedef std::map<const llvm::Function *, FunctionAnalysis> AnalysisCacheTy;
+
+// Return the unmangled name of pFunc, e.g. "rsForEach" for
+// "_Z9rsForEach9rs_script13rs_allocationS0_".
+llvm::StringRef getBaseName(const llvm::Function &pFunc) {
+  llvm::StringRef name = pFunc.getName();
+  if (!name.startswith("_Z")) {
+    return name;
+  }
+
+  size_t begin = 2;
+  while ((begin < name.size()) && isdigit(name[begin])) {
+    begin++;
+  }
+
+  unsigned length;
+  if (name.slice(2, begin).getAsInteger(10, length) ||
+      ((begin + length) > name.size())) {
+    return name;
+  }
+  return name.substr(begin, length);
+}
+
+bool isSerializingFunction(const llvm::Function &pFunc) {
+  llvm::StringRef base_name = getBaseName(pFunc);
+  if (base_name.startswith("rsg")) {
+    return true;
+  }
+  for (const char **func = serializing_functions; *func != NULL; func++) {
+    if (base_name == *func) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Return true if pPtr may point into a writable global variable. Only the
+// pointers known to point into the locals of the function, a constant global
+// or a function, or to come from a parameter of the function are safe. The
+// accesses through a parameter are accounted for at the call sites instead,
+// where passing a pointer which may point into a writable global counts as a
+// write to it. Anything else (a pointer loaded from memory or returned by a
+// call, an integer cast to a pointer, ...) may point anywhere.
+bool mayPointToWritableGlobal(llvm::Value *pPtr) {
+  llvm::SmallVector<llvm::Value *, 4> objects;
+  llvm::GetUnderlyingObjects(pPtr, objects);
+
+  for (size_t i = 0; i < objects.size(); i++) {
+    const llvm::Value *object = objects[i];
+    if (llvm::isa<llvm::AllocaInst>(object) ||
+        llvm::isa<llvm::Argument>(object) ||
+        llvm::isa<llvm::Function>(object) ||
+        llvm::isa<llvm::ConstantPointerNull>(object) ||
+        llvm::isa<llvm::UndefValue>(object)) {
+      continue;
+    }
+    const llvm::GlobalVariable *gv =
+        llvm::dyn_cast<llvm::GlobalVariable>(object);
+    if ((gv != NULL) && gv->isConstant()) {
+      continue;
+    }
+    return true;
+  }
+  return false;
+}
+
+// Return true if pCall may write through one of its pointer arguments into a
+// writable global variable. Arguments passed by value (byval) and those the
+// callee only reads are safe.
+bool mayWriteGlobalThroughArguments(const llvm::CallInst &pCall) {
+  if (pCall.onlyReadsMemory()) {
+    return false;
+  }
+
+  for (unsigned i = 0, e = pCall.getNumArgOperands(); i != e; i++) {
+    llvm::Value *arg = pCall.getArgOperand(i);
+    if (!arg->getType()->isPointerTy() ||
+        pCall.paramHasAttr(i + 1, llvm::Attribute::ByVal) ||
+        pCall.paramHasAttr(i + 1, llvm::Attribute::ReadOnly) ||
+        pCall.paramHasAttr(i + 1, llvm::Attribute::ReadNone)) {
+      continue;
+    }
+    if (mayPointToWritableGlobal(arg)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Analyze pFunc and the functions defined in the module it calls. The cost is
+// a weighted count of the instructions executed by a call, not counting the
+// loops inside it. A function is threadable only if it provably doesn't write
+// to a writable global (directly, with an atomic operation or through a
+// pointer it passes to another function) nor calls a serializing function.
+const FunctionAnalysis &analyzeFunction(const llvm::Function &pFunc,
+                                        AnalysisCacheTy &pCache) {
+  AnalysisCacheTy::iterator cached = pCache.find(&pFunc);
+  if (cached != pCache.end()) {
+    return cached->second;
+  }
+
+  // Break the cycles of recursive functions. The functions of a cycle aren't
+  // analyzed further and are conservatively not threadable.
+  FunctionAnalysis &result = pCache[&pFunc];
+  result.threadable = false;
+  result.cost = unknown_cost;
+
+  bool threadable = true;
+  uint64_t cost = 0;
+
+  for (llvm::Function::const_iterator bb = pFunc.begin(), bb_end = pFunc.end();
+       bb != bb_end; ++bb) {
+    for (llvm::BasicBlock::const_iterator inst_iter = bb->begin(),
+             inst_end = bb->end(); inst_iter != inst_end; ++inst_iter) {
+      const llvm::Instruction *inst = &*inst_iter;
+      if (llvm::isa<llvm::DbgInfoIntrinsic>(inst) ||
+          llvm::isa<llvm::PHINode>(inst)) {
+        continue;
+      }
+
+      switch (inst->getOpcode()) {
+        case llvm::Instruction::Store: {
+          const llvm::StoreInst *store = llvm::cast<llvm::StoreInst>(inst);
+          if (mayPointToWritableGlobal(
+                  const_cast<llvm::Value *>(store->getPointerOperand()))) {
+            threadable = false;
+          }
+          cost += 2;
+          break;
+        }
+        case llvm::Instruction::AtomicRMW: {
+          const llvm::AtomicRMWInst *rmw =
+              llvm::cast<llvm::AtomicRMWInst>(inst);
+          if (mayPointToWritableGlobal(
+                  const_cast<llvm::Value *>(rmw->getPointerOperand()))) {
+            threadable = false;
+          }
+          cost += 8;
+          break;
+        }
+        case llvm::Instruction::AtomicCmpXchg: {
+          const llvm::AtomicCmpXchgInst *cmpxchg =
+              llvm::cast<llvm::AtomicCmpXchgInst>(inst);
+          if (mayPointToWritableGlobal(
+                  const_cast<llvm::Value *>(cmpxchg->getPointerOperand()))) {
+            threadable = false;
+          }
+          cost += 8;
+          break;
+        }
+        case llvm::Instruction::Load: {
+          cost += 2;
+          break;
+        }
+        case llvm::Instruction::UDiv:
+        case llvm::Instruction::SDiv:
+        case llvm::Instruction::URem:
+        case llvm::Instruction::SRem:
+        case llvm::Instruction::FDiv:
+        case llvm::Instruction::FRem: {
+          cost += 8;
+          break;
+        }
+        case llvm::Instruction::Call: {
+          const llvm::CallInst *call = llvm::cast<llvm::CallInst>(inst);
+          const llvm::Function *callee = call->getCalledFunction();
+
+          if (const llvm::MemIntrinsic *mem =
+                  llvm::dyn_cast<llvm::MemIntrinsic>(call)) {
+            if (mayPointToWritableGlobal(mem->getRawDest())) {
+              threadable = false;
+            }
+            cost += 8;
+            break;
+          }
+
+          if (callee == NULL) {
+            // Indirect calls and inline assembly can't be analyzed.
+            threadable = false;
+            cost += unknown_cost;
+            break;
+          }
+
+          // E.g. rsAtomicInc(&g), rsSetObject(&g, ...) or a helper storing
+          // through its parameter.
+          if (mayWriteGlobalThroughArguments(*call)) {
+            threadable = false;
+          }
+
+          if (callee->isIntrinsic()) {
+            cost += 1;
+          } else if (callee->isDeclaration()) {
+            if (isSerializingFunction(*callee)) {
+              threadable = false;
+            }
+            // Functions of the runtime.
+            cost += 10;
+          } else {
+            const FunctionAnalysis &callee_analysis =
+                analyzeFunction(*callee, pCache);
+            threadable &= callee_analysis.threadable;
+            cost += callee_analysis.cost + 1;
+          }
+          break;
+        }
+        default: {
+          cost += 1;
+          break;
+        }
+      }
+    }
+  }
+
+  result.threadable = threadable;
+  result.cost = cost;
+  return result;
+}
+
+uint32_t getMinGrainSize(uint32_t pCost) {
+  if (pCost == 0) {
+    pCost = 1;
+  }
+  return (target_chunk_cost + pCost - 1) / pCost;
+}
+
+} // end anonymous namespace
+
+void RSInfo::analyzeForeachFuncs(const llvm::Module &pModule) {
+  AnalysisCacheTy cache;
+
+  // The chains of fused kernels, which have no function of their own yet.
+  std::map<llvm::StringRef, const llvm::MDNode *> fused_kernels;
+  const llvm::NamedMDNode *fusion =
+      pModule.getNamedMetadata(foreach_fusion_metadata_name);
+  if (fusion != NULL) {
+    for (unsigned i = 0, e = fusion->getNumOperands(); i != e; i++) {
+      const llvm::MDNode *node = fusion->getOperand(i);
+      const llvm::MDString *name = (node->getNumOperands() > 0) ?
+          llvm::dyn_cast_or_null<llvm::MDString>(node->getOperand(0)) : NULL;
+      if (name != NULL) {
+        fused_kernels[name->getString()] = node;
+      }
+    }
+  }
+
+  mExportForeachAnalyses.clear();
+  for (size_t i = 0; i < mExportForeachFuncs.size(); i++) {
+    llvm::StringRef name(mExportForeachFuncs[i].first);
+    ForeachAnalysis analysis;
+    analysis.threadable = false;
+    analysis.costPerElement = unknown_cost;
+
+    // A fused kernel runs each kernel of its chain on every element.
+    llvm::SmallVector<const llvm::Function *, 4> kernels;
+    std::map<llvm::StringRef, const llvm::MDNode *>::const_iterator chain =
+        fused_kernels.find(name);
+    bool found = true;
+    if (chain != fused_kernels.end()) {
+      const llvm::MDNode *node = chain->second;
+      for (unsigned j = 1, e = node->getNumOperands(); j != e; j++) {
+        const llvm::MDString *kernel_name =
+            llvm::dyn_cast_or_null<llvm::MDString>(node->getOperand(j));
+        const llvm::Function *kernel = (kernel_name != NULL) ?
+            pModule.getFunction(kernel_name->getString()) : NULL;
+        if (kernel == NULL) {
+          found = false;
+          break;
+        }
+        kernels.push_back(kernel);
+      }
+    } else if (const llvm::Function *kernel = pModule.getFunction(name)) {
+      kernels.push_back(kernel);
+    } else {
+      found = false;
+    }
+
+    if (found && !kernels.empty()) {
+      bool threadable = true;
+      uint64_t cost = 0;
+      for (size_t j = 0; j < kernels.size(); j++) {
+        if (kernels[j]->isDeclaration()) {
+          threadable = false;
+          cost += unknown_cost;
+          continue;
+        }
+        const FunctionAnalysis &kernel_analysis =
+            analyzeFunction(*kernels[j], cache);
+        threadable &= kernel_analysis.threadable;
+        cost += kernel_analysis.cost;
+      }
+      analysis.threadable = threadable;
+      analysis.costPerElement = (cost > 0xffffffffu) ?
+          0xffffffffu : static_cast<uint32_t>(cost);
+    } else {
+      ALOGW("Unable to analyze RS foreach function '%s'!",
+            mExportForeachFuncs[i].first);
+    }
+
+    analysis.minGrainSize = getMinGrainSize(analysis.costPerElement);
+    mExportForeachAnalyses.push(analysis);
+  }
+}
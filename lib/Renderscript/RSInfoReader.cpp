@@ -125,6 +125,72 @@ helper_read_list_item<rsinfo::ExportForeachFuncItem, RSInfo::ExportForeachFuncLi
   return true;
 }
 
+// Process AbsentExportFuncItem in the file
+template<> inline bool
+helper_read_list_item<rsinfo::AbsentExportFuncItem,
+                      RSInfo::AbsentExportFuncListTy>(
+    const rsinfo::AbsentExportFuncItem &pItem,
+    const RSInfo &pInfo,
+    RSInfo::AbsentExportFuncListTy &pResult)
+{
+  if (pItem.index >= pInfo.getExportFuncNames().size()) {
+    ALOGE("Invalid index %u in RS absent export funcs.", pItem.index);
+    return false;
+  }
+
+  pResult.push(pItem.index);
+  return true;
+}
+
+// Process AbsentExportForeachFuncItem in the file
+template<> inline bool
+helper_read_list_item<rsinfo::AbsentExportForeachFuncItem,
+                      RSInfo::AbsentExportForeachFuncListTy>(
+    const rsinfo::AbsentExportForeachFuncItem &pItem,
+    const RSInfo &pInfo,
+    RSInfo::AbsentExportForeachFuncListTy &pResult)
+{
+  if (pItem.index >= pInfo.getExportForeachFuncs().size()) {
+    ALOGE("Invalid index %u in RS absent export foreachs.", pItem.index);
+    return false;
+  }
+
+  pResult.push(pItem.index);
+  return true;
+}
+
+// Process ExportForeachAnalysisItem in the file
+template<> inline bool
+helper_read_list_item<rsinfo::ExportForeachAnalysisItem,
+                      RSInfo::ExportForeachAnalysisListTy>(
+    const rsinfo::ExportForeachAnalysisItem &pItem,
+    const RSInfo &pInfo,
+    RSInfo::ExportForeachAnalysisListTy &pResult)
+{
+  RSInfo::ForeachAnalysis analysis;
+  analysis.threadable = (pItem.isThreadable != 0);
+  analysis.costPerElement = pItem.costPerElement;
+  analysis.minGrainSize = pItem.minGrainSize;
+
+  pResult.push(analysis);
+  return true;
+}
+
+// Process ExportSymbolItem in the file
+template<> inline bool
+helper_read_list_item<rsinfo::ExportSymbolItem, RSInfo::ExportSymbolListTy>(
+    const rsinfo::ExportSymbolItem &pItem,
+    const RSInfo &pInfo,
+    RSInfo::ExportSymbolListTy &pResult)
+{
+  RSInfo::SymbolLocation location;
+  location.section = pItem.section;
+  location.offset = pItem.offset;
+
+  pResult.push(location);
+  return true;
+}
+
 template<typename ItemType, typename ItemContainer>
 inline bool helper_read_list(const uint8_t *pData,
                              const RSInfo &pInfo,
@@ -132,6 +198,9 @@ inline bool helper_read_list(const uint8_t *pData,
                              ItemContainer &pResult) {
   const ItemType *item;
 
+  // Size the list once instead of growing it item by item.
+  pResult.setCapacity(pHeader.count);
+
   // Out-of-range exception has been checked.
   for (uint32_t i = 0; i < pHeader.count; i++) {
     item = reinterpret_cast<const ItemType *>(pData +
@@ -205,7 +274,13 @@ RSInfo *RSInfo::ReadFromFile(InputFile &pInput) {
       (header->objectSlotList.itemSize != sizeof(rsinfo::ObjectSlotItem)) ||
       (header->exportVarNameList.itemSize != sizeof(rsinfo::ExportVarNameItem)) ||
       (header->exportFuncNameList.itemSize != sizeof(rsinfo::ExportFuncNameItem)) ||
-      (header->exportForeachFuncList.itemSize != sizeof(rsinfo::ExportForeachFuncItem))) {
+      (header->exportForeachFuncList.itemSize != sizeof(rsinfo::ExportForeachFuncItem)) ||
+      (header->absentExportFuncList.itemSize != sizeof(rsinfo::AbsentExportFuncItem)) ||
+      (header->absentExportForeachFuncList.itemSize !=
+          sizeof(rsinfo::AbsentExportForeachFuncItem)) ||
+      (header->exportForeachAnalysisList.itemSize !=
+          sizeof(rsinfo::ExportForeachAnalysisItem)) ||
+      (header->exportSymbolList.itemSize != sizeof(rsinfo::ExportSymbolItem))) {
     ALOGW("Corrupted RS info file %s! (unexpected size found)", input_filename);
     goto bail;
   }
@@ -218,36 +293,36 @@ RSInfo *RSInfo::ReadFromFile(InputFile &pInput) {
       (LIST_DATA_RANGE(header->objectSlotList) > filesize) ||
       (LIST_DATA_RANGE(header->exportVarNameList) > filesize) ||
       (LIST_DATA_RANGE(header->exportFuncNameList) > filesize) ||
-      (LIST_DATA_RANGE(header->exportForeachFuncList) > filesize)) {
+      (LIST_DATA_RANGE(header->exportForeachFuncList) > filesize) ||
+      (LIST_DATA_RANGE(header->absentExportFuncList) > filesize) ||
+      (LIST_DATA_RANGE(header->absentExportForeachFuncList) > filesize) ||
+      (LIST_DATA_RANGE(header->exportForeachAnalysisList) > filesize) ||
+      (LIST_DATA_RANGE(header->exportSymbolList) > filesize)) {
     ALOGW("Corrupted RS info file %s! (data out of the range)", input_filename);
     goto bail;
   }
 #undef LIST_DATA_RANGE
 
-  // File seems ok, create result RSInfo object.
-  result = new (std::nothrow) RSInfo(header->strPoolSize);
+  // File seems ok, create result RSInfo object. Its string pool is not
+  // allocated: the one in the file is used in place.
+  result = new (std::nothrow) RSInfo(/* pStringPoolSize */0);
   if (result == NULL) {
     ALOGE("Out of memory when create RSInfo object for %s!", input_filename);
     goto bail;
   }
 
-  // Make advice on our access pattern.
-  map->advise(android::FileMap::SEQUENTIAL);
-
   // Copy the header.
   ::memcpy(&result->mHeader, header, sizeof(rsinfo::Header));
 
+  // The string pool is immediately after the header at the offset
+  // header->headerSize. The strings handed out by the result point into the
+  // mapping, which is kept until the result is destroyed.
   if (header->strPoolSize > 0) {
-    // Copy the string pool. The string pool is immediately after the header at
-    // the offset header->headerSize.
-    if (result->mStringPool == NULL) {
-      ALOGE("Out of memory when allocate string pool for RS info file %s!",
-            input_filename);
-      goto bail;
-    }
-    ::memcpy(result->mStringPool, data + result->mHeader.headerSize,
-             result->mHeader.strPoolSize);
+    result->mStringPool = const_cast<char *>(
+        reinterpret_cast<const char *>(data + header->headerSize));
   }
+  result->mFileMap = map;
+  map = NULL;
 
   // Populate all the data to the result object.
   result->mSourceHash =
@@ -294,8 +369,50 @@ RSInfo *RSInfo::ReadFromFile(InputFile &pInput) {
     goto bail;
   }
 
-  // Clean up.
-  map->release();
+  if (!helper_read_list<rsinfo::AbsentExportFuncItem, AbsentExportFuncListTy>
+        (data, *result, header->absentExportFuncList,
+         result->mAbsentExportFuncs)) {
+    goto bail;
+  }
+
+  if (!helper_read_list<rsinfo::AbsentExportForeachFuncItem,
+                        AbsentExportForeachFuncListTy>
+        (data, *result, header->absentExportForeachFuncList,
+         result->mAbsentExportForeachFuncs)) {
+    goto bail;
+  }
+
+  if (!helper_read_list<rsinfo::ExportForeachAnalysisItem,
+                        ExportForeachAnalysisListTy>
+        (data, *result, header->exportForeachAnalysisList,
+         result->mExportForeachAnalyses)) {
+    goto bail;
+  }
+
+  if (!result->mExportForeachAnalyses.empty() &&
+      (result->mExportForeachAnalyses.size() !=
+       result->mExportForeachFuncs.size())) {
+    ALOGE("Invalid number of RS foreach analyses in %s (expected: %u, got: "
+          "%u)!", input_filename,
+          static_cast<unsigned>(result->mExportForeachFuncs.size()),
+          static_cast<unsigned>(result->mExportForeachAnalyses.size()));
+    goto bail;
+  }
+
+  if (!helper_read_list<rsinfo::ExportSymbolItem, ExportSymbolListTy>
+        (data, *result, header->exportSymbolList, result->mExportSymbols)) {
+    goto bail;
+  }
+
+  if (!result->mExportSymbols.empty() &&
+      (result->mExportSymbols.size() !=
+       (result->mExportVarNames.size() + result->mExportFuncNames.size() +
+        4 * result->mExportForeachFuncs.size()))) {
+    ALOGE("Invalid number of RS export symbols in %s (got: %u)!",
+          input_filename,
+          static_cast<unsigned>(result->mExportSymbols.size()));
+    goto bail;
+  }
 
   return result;
 
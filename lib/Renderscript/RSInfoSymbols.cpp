@@ -0,0 +1,206 @@
+/*
+ * Copyright 2014, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//===----------------------------------------------------------------------===//
+// This file implements RSInfo::recordExportSymbols()
+//===----------------------------------------------------------------------===//
+#include "bcc/Renderscript/RSInfo.h"
+
+#include <cstring>
+#include <map>
+#include <utility>
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/ELF.h>
+
+#include <utils/FileMap.h>
+#include <utils/String8.h>
+
+#include "bcc/Support/InputFile.h"
+#include "bcc/Support/Log.h"
+
+using namespace bcc;
+
+namespace {
+
+typedef std::map<llvm::StringRef, RSInfo::SymbolLocation> SymbolMapTy;
+
+// Collect the location of the symbols defined in the allocated sections of the
+// ELF relocatable object at pData. The values of such symbols are offsets in
+// their section, which the object loader keeps at the same index. When several
+// symbols have the same name, the first one in the table wins, like in the
+// index of the symbols the object loader builds; if it isn't in an allocated
+// section, its location is left unknown so that it's looked up by name.
+template<typename Ehdr, typename Shdr, typename Sym>
+bool readSymbols(const uint8_t *pData, size_t pSize, SymbolMapTy &pResult) {
+  const Ehdr *header = reinterpret_cast<const Ehdr *>(pData);
+  if ((pSize < sizeof(Ehdr)) ||
+      (header->e_type != llvm::ELF::ET_REL) ||
+      (header->e_shentsize != sizeof(Shdr)) ||
+      (header->e_shoff > pSize) ||
+      ((pSize - header->e_shoff) / sizeof(Shdr) < header->e_shnum)) {
+    return false;
+  }
+
+  const Shdr *sections = reinterpret_cast<const Shdr *>(pData +
+                                                        header->e_shoff);
+  for (unsigned i = 0; i < header->e_shnum; i++) {
+    const Shdr &symtab = sections[i];
+    if ((symtab.sh_type != llvm::ELF::SHT_SYMTAB) ||
+        (symtab.sh_link >= header->e_shnum) ||
+        (symtab.sh_offset > pSize) ||
+        (symtab.sh_size > pSize - symtab.sh_offset)) {
+      continue;
+    }
+
+    const Shdr &strtab = sections[symtab.sh_link];
+    if ((strtab.sh_offset > pSize) ||
+        (strtab.sh_size > pSize - strtab.sh_offset)) {
+      continue;
+    }
+    const char *strings = reinterpret_cast<const char *>(pData +
+                                                         strtab.sh_offset);
+
+    const Sym *symbols = reinterpret_cast<const Sym *>(pData +
+                                                       symtab.sh_offset);
+    for (size_t j = 0, e = symtab.sh_size / sizeof(Sym); j < e; j++) {
+      const Sym &symbol = symbols[j];
+      if (symbol.st_name >= strtab.sh_size) {
+        continue;
+      }
+
+      const char *name = strings + symbol.st_name;
+      size_t name_length = ::strnlen(name, strtab.sh_size - symbol.st_name);
+      if ((name_length == 0) ||
+          (name_length == strtab.sh_size - symbol.st_name)) {
+        continue;
+      }
+
+      RSInfo::SymbolLocation location;
+      location.section = 0;
+      location.offset = 0;
+      if ((symbol.st_shndx != llvm::ELF::SHN_UNDEF) &&
+          (symbol.st_shndx < header->e_shnum) &&
+          (sections[symbol.st_shndx].sh_flags & llvm::ELF::SHF_ALLOC) &&
+          (symbol.st_value <= 0xffffffffu)) {
+        location.section = symbol.st_shndx;
+        location.offset = static_cast<uint32_t>(symbol.st_value);
+      }
+
+      // Doesn't replace the location of an earlier symbol of the same name.
+      pResult.insert(std::make_pair(llvm::StringRef(name, name_length),
+                                    location));
+    }
+  }
+
+  return true;
+}
+
+RSInfo::SymbolLocation lookupSymbol(const SymbolMapTy &pSymbols,
+                                    const char *pName,
+                                    const char *pSuffix = NULL) {
+  SymbolMapTy::const_iterator symbol;
+  if (pSuffix == NULL) {
+    symbol = pSymbols.find(pName);
+  } else {
+    android::String8 name(pName);
+    name.append(pSuffix);
+    symbol = pSymbols.find(name.string());
+  }
+
+  if (symbol != pSymbols.end()) {
+    return symbol->second;
+  }
+
+  // Not in the object, so don't look it up at load time either. This is the
+  // case of the variants the expand pass doesn't generate for some kernels.
+  RSInfo::SymbolLocation absent;
+  absent.section = RSINFO_ABSENT_SECTION;
+  absent.offset = 0;
+  return absent;
+}
+
+} // end anonymous namespace
+
+bool RSInfo::recordExportSymbols(const char *pObjectPath) {
+  mExportSymbols.clear();
+
+  InputFile object_file(pObjectPath, FileBase::kBinary);
+  if (object_file.hasError()) {
+    ALOGE("Unable to open %s to locate the RS exports! (%s)", pObjectPath,
+          object_file.getErrorMessage().c_str());
+    return false;
+  }
+
+  size_t size = object_file.getSize();
+  if (object_file.hasError() || (size < llvm::ELF::EI_NIDENT)) {
+    ALOGE("Unable to get the size of %s to locate the RS exports!",
+          pObjectPath);
+    return false;
+  }
+
+  android::FileMap *map = object_file.createMap(/* pOffset */0, size);
+  if (map == NULL) {
+    ALOGE("Unable to map %s to locate the RS exports! (%s)", pObjectPath,
+          object_file.getErrorMessage().c_str());
+    return false;
+  }
+
+  const uint8_t *data = reinterpret_cast<const uint8_t *>(map->getDataPtr());
+
+  // The object loader only reads little-endian objects.
+  SymbolMapTy symbols;
+  bool read = false;
+  if ((::memcmp(data, llvm::ELF::ElfMagic, 4) == 0) &&
+      (data[llvm::ELF::EI_DATA] == llvm::ELF::ELFDATA2LSB)) {
+    if (data[llvm::ELF::EI_CLASS] == llvm::ELF::ELFCLASS64) {
+      read = readSymbols<llvm::ELF::Elf64_Ehdr, llvm::ELF::Elf64_Shdr,
+                         llvm::ELF::Elf64_Sym>(data, size, symbols);
+    } else if (data[llvm::ELF::EI_CLASS] == llvm::ELF::ELFCLASS32) {
+      read = readSymbols<llvm::ELF::Elf32_Ehdr, llvm::ELF::Elf32_Shdr,
+                         llvm::ELF::Elf32_Sym>(data, size, symbols);
+    }
+  }
+
+  if (!read) {
+    ALOGW("Unable to read the symbol table of %s! RS exports will be looked "
+          "up by name.", pObjectPath);
+    map->release();
+    return false;
+  }
+
+  for (size_t i = 0; i < mExportVarNames.size(); i++) {
+    mExportSymbols.push(lookupSymbol(symbols, mExportVarNames[i]));
+  }
+
+  for (size_t i = 0; i < mExportFuncNames.size(); i++) {
+    mExportSymbols.push(lookupSymbol(symbols, mExportFuncNames[i]));
+  }
+
+  static const char *const foreach_suffixes[] = {
+    ".expand", ".expand_spans", ".expand_indexed", ".expand64", NULL
+  };
+  for (const char *const *suffix = foreach_suffixes; *suffix != NULL;
+       suffix++) {
+    for (size_t i = 0; i < mExportForeachFuncs.size(); i++) {
+      mExportSymbols.push(lookupSymbol(symbols, mExportForeachFuncs[i].first,
+                                       *suffix));
+    }
+  }
+
+  map->release();
+  return true;
+}
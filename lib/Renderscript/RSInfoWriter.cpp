@@ -15,11 +15,18 @@
  */
 
 //===----------------------------------------------------------------------===//
-// This file implements RSInfo::write()
+// This file implements RSInfo::write() and RSInfo::writeFile()
 //===----------------------------------------------------------------------===//
 
 #include "bcc/Renderscript/RSInfo.h"
 
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+#include <utils/String8.h>
+
 #include "bcc/Support/Log.h"
 #include "bcc/Support/OutputFile.h"
 
@@ -112,6 +119,48 @@ helper_adapt_list_item<rsinfo::ExportForeachFuncItem,
   return true;
 }
 
+template<> inline bool
+helper_adapt_list_item<rsinfo::AbsentExportFuncItem,
+                       RSInfo::AbsentExportFuncListTy>(
+    rsinfo::AbsentExportFuncItem &pResult,
+    const RSInfo &pInfo,
+    const RSInfo::AbsentExportFuncListTy::const_iterator &pItem) {
+  pResult.index = *pItem;
+  return true;
+}
+
+template<> inline bool
+helper_adapt_list_item<rsinfo::AbsentExportForeachFuncItem,
+                       RSInfo::AbsentExportForeachFuncListTy>(
+    rsinfo::AbsentExportForeachFuncItem &pResult,
+    const RSInfo &pInfo,
+    const RSInfo::AbsentExportForeachFuncListTy::const_iterator &pItem) {
+  pResult.index = *pItem;
+  return true;
+}
+
+template<> inline bool
+helper_adapt_list_item<rsinfo::ExportForeachAnalysisItem,
+                       RSInfo::ExportForeachAnalysisListTy>(
+    rsinfo::ExportForeachAnalysisItem &pResult,
+    const RSInfo &pInfo,
+    const RSInfo::ExportForeachAnalysisListTy::const_iterator &pItem) {
+  pResult.isThreadable = static_cast<uint8_t>(pItem->threadable);
+  pResult.costPerElement = pItem->costPerElement;
+  pResult.minGrainSize = pItem->minGrainSize;
+  return true;
+}
+
+template<> inline bool
+helper_adapt_list_item<rsinfo::ExportSymbolItem, RSInfo::ExportSymbolListTy>(
+    rsinfo::ExportSymbolItem &pResult,
+    const RSInfo &pInfo,
+    const RSInfo::ExportSymbolListTy::const_iterator &pItem) {
+  pResult.section = pItem->section;
+  pResult.offset = pItem->offset;
+  return true;
+}
+
 template<typename ItemType, typename ItemContainer>
 inline bool helper_write_list(OutputFile &pOutput,
                               const RSInfo &pInfo,
@@ -201,5 +250,67 @@ bool RSInfo::write(OutputFile &pOutput) {
     return false;
   }
 
+  // Write absentExportFuncList.
+  if (!helper_write_list<rsinfo::AbsentExportFuncItem, AbsentExportFuncListTy>
+        (pOutput, *this, mHeader.absentExportFuncList, mAbsentExportFuncs)) {
+    return false;
+  }
+
+  // Write absentExportForeachFuncList.
+  if (!helper_write_list<rsinfo::AbsentExportForeachFuncItem,
+                         AbsentExportForeachFuncListTy>
+        (pOutput, *this, mHeader.absentExportForeachFuncList,
+         mAbsentExportForeachFuncs)) {
+    return false;
+  }
+
+  // Write exportForeachAnalysisList.
+  if (!helper_write_list<rsinfo::ExportForeachAnalysisItem,
+                         ExportForeachAnalysisListTy>
+        (pOutput, *this, mHeader.exportForeachAnalysisList,
+         mExportForeachAnalyses)) {
+    return false;
+  }
+
+  // Write exportSymbolList.
+  if (!helper_write_list<rsinfo::ExportSymbolItem, ExportSymbolListTy>
+        (pOutput, *this, mHeader.exportSymbolList, mExportSymbols)) {
+    return false;
+  }
+
+  return true;
+}
+
+bool RSInfo::writeFile(const char *pInfoPath) {
+  // The name of the temporary file is unique to this RSInfo so that
+  // concurrent writers of pInfoPath don't write to the same temporary.
+  android::String8 temp_path(pInfoPath);
+  temp_path.appendFormat(".%d.%p.tmp", static_cast<int>(::getpid()), this);
+
+  OutputFile temp_file(temp_path.string(), FileBase::kTruncate);
+  if (temp_file.hasError()) {
+    ALOGE("Failed to open the info file %s for write! (%s)",
+          temp_path.string(), temp_file.getErrorMessage().c_str());
+    return false;
+  }
+
+  bool written = write(temp_file);
+  temp_file.close();
+  if (!written) {
+    ::unlink(temp_path.string());
+    return false;
+  }
+
+#ifdef USE_MINGW
+  // rename() doesn't replace an existing file on Windows.
+  ::unlink(pInfoPath);
+#endif
+  if (::rename(temp_path.string(), pInfoPath) != 0) {
+    ALOGE("Failed to replace the info file %s with %s! (%s)", pInfoPath,
+          temp_path.string(), ::strerror(errno));
+    ::unlink(temp_path.string());
+    return false;
+  }
+
   return true;
 }
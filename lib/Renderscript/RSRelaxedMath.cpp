@@ -0,0 +1,180 @@
+/*
+ * Copyright 2014, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bcc/Renderscript/RSTransforms.h"
+
+#include <cctype>
+#include <string>
+#include <vector>
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Operator.h>
+#include <llvm/Pass.h>
+
+using namespace bcc;
+
+namespace {
+
+// Functions of the Renderscript runtime which have a native_ variant trading
+// precision for speed.
+const char *gNativeMathFunctions[] = {
+  "acos", "acosh", "acospi", "asin", "asinh", "asinpi", "atan", "atan2",
+  "atan2pi", "atanh", "atanpi", "cbrt", "cos", "cosh", "cospi", "distance",
+  "exp", "exp10", "exp2", "expm1", "hypot", "length", "log", "log10", "log1p",
+  "log2", "normalize", "powr", "rootn", "rsqrt", "sin", "sincos", "sinh",
+  "sinpi", "sqrt", "tan", "tanh", "tanpi", NULL
+};
+
+/* RSRelaxedMathPass - This pass relaxes the floating point semantics of a
+ * script which requested rs_fp_relaxed. It runs on the script before it is
+ * linked with the Renderscript runtime, so that only the code of the script
+ * itself is affected:
+ *
+ *  - Floating point instructions are marked with the fast-math flags, which
+ *    allows reassociation, reciprocal approximations and FMA contraction.
+ *  - The functions defined by the script get the "unsafe-fp-math" attribute,
+ *    so that the code generator relaxes them (and only them) as well.
+ *  - Calls to the math functions of the runtime are redirected to their
+ *    native_ variants, when the runtime defines them.
+ */
+class RSRelaxedMathPass : public llvm::ModulePass {
+private:
+  static char ID;
+
+  const llvm::Module *mRuntime;
+
+  /// @brief Return the mangled name of the native_ variant of the runtime
+  /// function named pName, or an empty string if there is none.
+  std::string getNativeName(llvm::StringRef pName) {
+    // Only look at the _Z<length><name><parameters> names of the functions
+    // of the runtime.
+    if (!pName.startswith("_Z")) {
+      return "";
+    }
+
+    size_t NameBegin = 2;
+    while (NameBegin < pName.size() && isdigit(pName[NameBegin])) {
+      NameBegin++;
+    }
+
+    unsigned Length;
+    if (pName.slice(2, NameBegin).getAsInteger(10, Length) ||
+        NameBegin + Length > pName.size()) {
+      return "";
+    }
+
+    llvm::StringRef BaseName = pName.substr(NameBegin, Length);
+    for (const char **Func = gNativeMathFunctions; *Func != NULL; Func++) {
+      if (BaseName == *Func) {
+        return "_Z" + llvm::utostr(Length + 7) + "native_" + BaseName.str() +
+               pName.substr(NameBegin + Length).str();
+      }
+    }
+
+    return "";
+  }
+
+  /// @brief Redirect the calls to pCallee to the native_ variant of it.
+  bool replaceWithNative(llvm::Module &M, llvm::Function *pCallee) {
+    std::string NativeName = getNativeName(pCallee->getName());
+    if (NativeName.empty()) {
+      return false;
+    }
+
+    const llvm::Function *RuntimeNative = mRuntime->getFunction(NativeName);
+    if ((RuntimeNative == NULL) || RuntimeNative->isDeclaration() ||
+        (RuntimeNative->getFunctionType() != pCallee->getFunctionType())) {
+      return false;
+    }
+
+    llvm::Constant *Native =
+        M.getOrInsertFunction(NativeName, pCallee->getFunctionType(),
+                              pCallee->getAttributes());
+    pCallee->replaceAllUsesWith(Native);
+    return true;
+  }
+
+public:
+  RSRelaxedMathPass(const llvm::Module *pRuntime)
+      : ModulePass(ID), mRuntime(pRuntime) {
+  }
+
+  virtual bool runOnModule(llvm::Module &M) {
+    bool Changed = false;
+
+    llvm::FastMathFlags FMF;
+    FMF.setUnsafeAlgebra();
+
+    for (llvm::Module::iterator FI = M.begin(), FE = M.end(); FI != FE; ++FI) {
+      if (!FI->isDeclaration()) {
+        FI->addFnAttr("unsafe-fp-math", "true");
+        Changed = true;
+      }
+      for (llvm::Function::iterator BI = FI->begin(), BE = FI->end();
+           BI != BE; ++BI) {
+        for (llvm::BasicBlock::iterator I = BI->begin(), IE = BI->end();
+             I != IE; ++I) {
+          if (llvm::isa<llvm::BinaryOperator>(I) &&
+              I->getType()->isFPOrFPVectorTy()) {
+            I->setFastMathFlags(FMF);
+            Changed = true;
+          }
+        }
+      }
+    }
+
+    if (mRuntime == NULL) {
+      return Changed;
+    }
+
+    // Collect the declarations first since replaceWithNative() may add new
+    // ones to the module.
+    std::vector<llvm::Function *> Declarations;
+    for (llvm::Module::iterator FI = M.begin(), FE = M.end(); FI != FE; ++FI) {
+      if (FI->isDeclaration() && !FI->use_empty()) {
+        Declarations.push_back(FI);
+      }
+    }
+
+    for (size_t i = 0; i < Declarations.size(); i++) {
+      Changed |= replaceWithNative(M, Declarations[i]);
+    }
+
+    return Changed;
+  }
+
+  virtual const char *getPassName() const {
+    return "Relax floating point math";
+  }
+
+}; // end RSRelaxedMathPass
+
+} // end anonymous namespace
+
+char RSRelaxedMathPass::ID = 0;
+
+namespace bcc {
+
+llvm::ModulePass *
+createRSRelaxedMathPass(const llvm::Module *pRuntime) {
+  return new RSRelaxedMathPass(pRuntime);
+}
+
+} // end namespace bcc
@@ -16,10 +16,16 @@
 
 #include "bcc/Renderscript/RSScript.h"
 
+#include <new>
+
+#include <llvm/PassManager.h>
+
 #include "bcc/Assert.h"
 #include "bcc/Renderscript/RSInfo.h"
+#include "bcc/Renderscript/RSTransforms.h"
 #include "bcc/Source.h"
 #include "bcc/Support/Log.h"
+#include "bcinfo/MetadataExtractor.h"
 
 using namespace bcc;
 
@@ -40,6 +46,17 @@ bool RSScript::LinkRuntime(RSScript &pScript, const char *core_lib) {
         &pScript.getSource().getModule(), &libclcore_source->getModule());
   }
 
+  // Relax the floating point math of the script if it asked for it. This is
+  // done before linking so that the runtime keeps its own semantics.
+  if ((pScript.getInfo() != NULL) &&
+      (pScript.getInfo()->getFloatPrecisionRequirement() ==
+       RSInfo::FP_Relaxed)) {
+    llvm::PassManager relaxed_math_passes;
+    relaxed_math_passes.add(
+        createRSRelaxedMathPass(&libclcore_source->getModule()));
+    relaxed_math_passes.run(pScript.getSource().getModule());
+  }
+
   if (!pScript.getSource().merge(*libclcore_source,
                                  /* pPreserveSource */false)) {
     ALOGE("Failed to link Renderscript library '%s'!", core_lib);
@@ -53,11 +70,45 @@ bool RSScript::LinkRuntime(RSScript &pScript, const char *core_lib) {
 RSScript::RSScript(Source &pSource)
   : Script(pSource), mInfo(NULL), mCompilerVersion(0),
     mOptimizationLevel(kOptLvl3), mLinkRuntimeCallback(NULL),
-    mEmbedInfo(false) { }
+    mEmbedInfo(false), mPrefetchDistance(0),
+    mEnableNonTemporalStores(false), mKernelStatsMode(RSKernelStatsNone),
+    mMetadata(NULL) { }
+
+RSScript::~RSScript() {
+  delete mInfo;
+  delete mMetadata;
+}
+
+bool RSScript::extractMetadata() {
+  delete mMetadata;
+
+  mMetadata = new (std::nothrow)
+      bcinfo::MetadataExtractor(&getSource().getModule());
+  if (mMetadata == NULL) {
+    ALOGE("Out of memory when extracting the metadata of the script!");
+    return false;
+  }
+
+  if (!mMetadata->extract()) {
+    ALOGE("Could not extract metadata from module!");
+    delete mMetadata;
+    mMetadata = NULL;
+    return false;
+  }
+
+  return true;
+}
 
 bool RSScript::doReset() {
   mInfo = NULL;
+  // The metadata belongs to the previous source.
+  delete mMetadata;
+  mMetadata = NULL;
   mCompilerVersion = 0;
   mOptimizationLevel = kOptLvl3;
+  mPrefetchDistance = 0;
+  mEnableNonTemporalStores = false;
+  mExportVarValues.clear();
+  mKernelStatsMode = RSKernelStatsNone;
   return true;
 }
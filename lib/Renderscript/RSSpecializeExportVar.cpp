@@ -0,0 +1,226 @@
+/*
+ * Copyright 2014, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bcc/Assert.h"
+#include "bcc/Renderscript/RSTransforms.h"
+
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Pass.h>
+
+#include "bcc/Support/Log.h"
+
+using namespace bcc;
+
+namespace {
+
+/* RSSpecializeExportVarPass - This pass specializes a script on the values of
+ * some of its exported variables, which the host promised not to change after
+ * the script is loaded. Every use of such a variable is redirected to an
+ * internal constant copy initialized with the given value, so that later
+ * passes can fold the loads away. The exported variable itself is kept so that
+ * the runtime can still find it.
+ */
+class RSSpecializeExportVarPass : public llvm::ModulePass {
+private:
+  static char ID;
+
+  RSExportVarValueMapTy mValues;
+
+  /// @brief Build the constant of type Ty whose in-memory representation is
+  /// the bytes at Data.
+  ///
+  /// @return NULL if Ty cannot be specialized (e.g. it contains pointers.)
+  llvm::Constant *createConstant(const llvm::DataLayout &DL, llvm::Type *Ty,
+                                 const uint8_t *Data) {
+    if (Ty->isIntegerTy() || Ty->isFloatingPointTy()) {
+      unsigned NumBits = Ty->getPrimitiveSizeInBits();
+      unsigned NumBytes = DL.getTypeStoreSize(Ty);
+      if (NumBits > 64) {
+        return NULL;
+      }
+
+      uint64_t Bits = 0;
+      for (unsigned i = 0; i < NumBytes; ++i) {
+        unsigned Shift = DL.isLittleEndian() ? i : (NumBytes - 1 - i);
+        Bits |= static_cast<uint64_t>(Data[i]) << (8 * Shift);
+      }
+
+      llvm::IntegerType *IntTy =
+          llvm::IntegerType::get(Ty->getContext(), NumBits);
+      llvm::Constant *C = llvm::ConstantInt::get(IntTy, Bits);
+      if (Ty->isFloatingPointTy()) {
+        C = llvm::ConstantExpr::getBitCast(C, Ty);
+      }
+      return C;
+    }
+
+    if (llvm::VectorType *VT = llvm::dyn_cast<llvm::VectorType>(Ty)) {
+      llvm::Type *ElementTy = VT->getElementType();
+      uint64_t ElementSize = DL.getTypeAllocSize(ElementTy);
+      llvm::SmallVector<llvm::Constant*, 16> Elements;
+      for (unsigned i = 0; i < VT->getNumElements(); ++i) {
+        llvm::Constant *C = createConstant(DL, ElementTy,
+                                           Data + i * ElementSize);
+        if (C == NULL) {
+          return NULL;
+        }
+        Elements.push_back(C);
+      }
+      return llvm::ConstantVector::get(Elements);
+    }
+
+    if (llvm::ArrayType *AT = llvm::dyn_cast<llvm::ArrayType>(Ty)) {
+      llvm::Type *ElementTy = AT->getElementType();
+      uint64_t ElementSize = DL.getTypeAllocSize(ElementTy);
+      std::vector<llvm::Constant*> Elements;
+      for (uint64_t i = 0; i < AT->getNumElements(); ++i) {
+        llvm::Constant *C = createConstant(DL, ElementTy,
+                                           Data + i * ElementSize);
+        if (C == NULL) {
+          return NULL;
+        }
+        Elements.push_back(C);
+      }
+      return llvm::ConstantArray::get(AT, Elements);
+    }
+
+    if (llvm::StructType *ST = llvm::dyn_cast<llvm::StructType>(Ty)) {
+      const llvm::StructLayout *Layout = DL.getStructLayout(ST);
+      std::vector<llvm::Constant*> Elements;
+      for (unsigned i = 0; i < ST->getNumElements(); ++i) {
+        llvm::Constant *C = createConstant(DL, ST->getElementType(i),
+                                           Data + Layout->getElementOffset(i));
+        if (C == NULL) {
+          return NULL;
+        }
+        Elements.push_back(C);
+      }
+      return llvm::ConstantStruct::get(ST, Elements);
+    }
+
+    // Pointers (and thus RS object types) cannot be specialized.
+    return NULL;
+  }
+
+  /// @brief Check that the script only ever reads from pValue.
+  bool isOnlyLoaded(const llvm::Value *pValue) {
+    for (llvm::Value::const_user_iterator UI = pValue->user_begin(),
+                                          UE = pValue->user_end();
+         UI != UE; ++UI) {
+      const llvm::User *U = *UI;
+      if (llvm::isa<llvm::LoadInst>(U)) {
+        continue;
+      }
+      const llvm::ConstantExpr *CE = llvm::dyn_cast<llvm::ConstantExpr>(U);
+      if (CE != NULL &&
+          (CE->getOpcode() == llvm::Instruction::GetElementPtr ||
+           CE->getOpcode() == llvm::Instruction::BitCast) &&
+          isOnlyLoaded(CE)) {
+        continue;
+      }
+      const llvm::Instruction *I = llvm::dyn_cast<llvm::Instruction>(U);
+      if (I != NULL &&
+          (llvm::isa<llvm::GetElementPtrInst>(I) ||
+           llvm::isa<llvm::BitCastInst>(I)) &&
+          isOnlyLoaded(I)) {
+        continue;
+      }
+      return false;
+    }
+    return true;
+  }
+
+public:
+  RSSpecializeExportVarPass(const RSExportVarValueMapTy &pValues)
+      : ModulePass(ID), mValues(pValues) {
+  }
+
+  virtual bool runOnModule(llvm::Module &M) {
+    bool Changed = false;
+    llvm::DataLayout DL(&M);
+
+    for (RSExportVarValueMapTy::const_iterator I = mValues.begin(),
+                                               E = mValues.end();
+         I != E; ++I) {
+      const char *Name = I->first.c_str();
+      const std::vector<uint8_t> &Value = I->second;
+
+      llvm::GlobalVariable *GV = M.getNamedGlobal(I->first);
+      if (GV == NULL || GV->isDeclaration()) {
+        ALOGW("Unable to specialize script on unknown variable '%s'", Name);
+        continue;
+      }
+
+      llvm::Type *Ty = GV->getType()->getElementType();
+      if (Value.size() < DL.getTypeStoreSize(Ty) ||
+          Value.size() > DL.getTypeAllocSize(Ty)) {
+        ALOGW("Unable to specialize script on variable '%s': expected %u "
+              "bytes, got %u", Name,
+              static_cast<unsigned>(DL.getTypeAllocSize(Ty)),
+              static_cast<unsigned>(Value.size()));
+        continue;
+      }
+
+      if (!isOnlyLoaded(GV)) {
+        ALOGW("Unable to specialize script on variable '%s': it is written to "
+              "or its address escapes", Name);
+        continue;
+      }
+
+      llvm::Constant *Init = createConstant(DL, Ty, &Value[0]);
+      if (Init == NULL) {
+        ALOGW("Unable to specialize script on variable '%s' of unsupported "
+              "type", Name);
+        continue;
+      }
+
+      llvm::GlobalVariable *Specialized =
+          new llvm::GlobalVariable(M, Ty, /* isConstant */true,
+                                   llvm::GlobalValue::InternalLinkage, Init,
+                                   GV->getName() + ".specialized");
+      Specialized->setAlignment(GV->getAlignment());
+
+      GV->replaceAllUsesWith(Specialized);
+      GV->setInitializer(Init);
+      Changed = true;
+    }
+
+    return Changed;
+  }
+
+  virtual const char *getPassName() const {
+    return "Specialize on exported variables";
+  }
+
+}; // end RSSpecializeExportVarPass
+
+} // end anonymous namespace
+
+char RSSpecializeExportVarPass::ID = 0;
+
+namespace bcc {
+
+llvm::ModulePass *
+createRSSpecializeExportVarPass(const RSExportVarValueMapTy &pValues) {
+  return new RSSpecializeExportVarPass(pValues);
+}
+
+} // end namespace bcc